@@ -0,0 +1,296 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Just enough of the FlatBuffers encoding to write the metadata of Arrow IPC messages, without depending on the
+ * flatbuffers or Arrow libraries.
+ * The buffer is built front to back. A table is written with a slot for each field that refers to another object, and
+ * the slot is patched once the object has been written after it, since references always have to point forwards.
+ * Everything is little endian, which is all that Arrow supports on the platforms we build for.
+ */
+class FlatbufferBuilder
+{
+public:
+    /**
+     * A field of a table. Fields that refer to another object are written as a slot to patch later.
+     */
+    class Field
+    {
+    public:
+        uint16_t id;
+        uint8_t size; /// 1, 2, 4 or 8 bytes
+        uint64_t value;
+        bool is_reference;
+    };
+
+    std::vector<uint8_t> bytes;
+
+    FlatbufferBuilder()
+    {
+        put<uint32_t>(0); /// The reference to the root table
+    }
+
+    template<typename T>
+    void put(T value)
+    {
+        size_t at = bytes.size();
+        bytes.resize(at + sizeof(T));
+        memcpy(bytes.data() + at, &value, sizeof(T));
+    }
+
+    template<typename T>
+    void patch(size_t at, T value)
+    {
+        memcpy(bytes.data() + at, &value, sizeof(T));
+    }
+
+    void pad_to(size_t alignment, size_t remainder = 0)
+    {
+        while(bytes.size() % alignment != remainder)
+            bytes.push_back(0);
+    }
+
+    /**
+     * Points a reference slot, or the root reference if slot is 0, at an object that has just been written.
+     */
+    void refer(size_t slot, size_t object)
+    {
+        patch<uint32_t>(slot, uint32_t(object - slot));
+    }
+
+    /**
+     * Writes a table and its vtable. Returns where the table starts, and the slot of each reference field in
+     * reference_slots in the order they were given.
+     */
+    size_t table(std::vector<Field> fields, std::vector<size_t>& reference_slots)
+    {
+        size_t field_count = 0;
+        for(auto& field : fields)
+            field_count = std::max<size_t>(field_count, field.id + 1);
+
+        /// The vtable gives the position of each field in the table, 0 for a missing field
+        pad_to(2);
+        size_t vtable = bytes.size();
+        put<uint16_t>(uint16_t(4 + 2*field_count));
+        put<uint16_t>(0);
+        for(size_t i = 0; i < field_count; i++)
+            put<uint16_t>(0);
+
+        /// Lay out the fields largest first after the vtable offset, so they are all naturally aligned
+        pad_to(8, 4);
+        size_t table_start = bytes.size();
+        put<int32_t>(int32_t(table_start - vtable));
+        std::stable_sort(fields.begin(), fields.end(), [](const Field& a, const Field& b)
+        {
+            return a.size > b.size;
+        });
+        std::vector<std::pair<uint16_t, size_t>> reference_positions;
+        for(auto& field : fields)
+        {
+            size_t at = bytes.size();
+            patch<uint16_t>(vtable + 4 + 2*field.id, uint16_t(at - table_start));
+            bytes.resize(at + field.size);
+            memcpy(bytes.data() + at, &field.value, field.size);
+            if(field.is_reference)
+                reference_positions.emplace_back(field.id, at);
+        }
+        patch<uint16_t>(vtable + 2, uint16_t(bytes.size() - table_start));
+
+        /// Hand back the slots in the order the caller listed them
+        reference_slots.clear();
+        std::stable_sort(reference_positions.begin(), reference_positions.end());
+        for(auto& reference : reference_positions)
+            reference_slots.push_back(reference.second);
+        return table_start;
+    }
+
+    /**
+     * Writes the length of a vector whose elements are element_alignment aligned, returns where the vector starts.
+     */
+    size_t vector(uint32_t length, size_t element_alignment)
+    {
+        pad_to(std::max<size_t>(4, element_alignment), std::max<size_t>(4, element_alignment) - 4);
+        size_t vector_start = bytes.size();
+        put<uint32_t>(length);
+        return vector_start;
+    }
+
+    size_t string(const std::string& text)
+    {
+        size_t string_start = vector(uint32_t(text.size()), 1);
+        bytes.insert(bytes.end(), text.begin(), text.end());
+        bytes.push_back(0);
+        return string_start;
+    }
+};
+
+/**
+ * Wraps flatbuffer metadata as an encapsulated Arrow IPC message: a continuation marker, the padded length of the
+ * metadata and the metadata itself, padded so the body that follows starts 8 byte aligned.
+ */
+inline std::vector<uint8_t> arrow_message(FlatbufferBuilder& metadata)
+{
+    metadata.pad_to(8);
+    uint32_t prefix[2] = {0xFFFFFFFF, uint32_t(metadata.bytes.size())};
+    std::vector<uint8_t> message(8 + metadata.bytes.size());
+    memcpy(message.data(), prefix, sizeof(prefix));
+    memcpy(message.data() + sizeof(prefix), metadata.bytes.data(), metadata.bytes.size());
+    return message;
+}
+
+/**
+ * The enum and union values from the Arrow format's Schema.fbs and Message.fbs.
+ */
+static const uint16_t ARROW_METADATA_V5 = 4;
+static const uint8_t ARROW_HEADER_SCHEMA = 1;
+static const uint8_t ARROW_HEADER_RECORD_BATCH = 3;
+static const uint8_t ARROW_TYPE_UTF8 = 5;
+
+/**
+ * The message that starts an Arrow IPC stream with a single nullable utf8 column.
+ */
+inline std::vector<uint8_t> arrow_schema_message(const std::string& column_name)
+{
+    typedef FlatbufferBuilder::Field Field;
+    FlatbufferBuilder builder;
+    std::vector<size_t> slots;
+
+    /// Message { version, header_type, header: Schema, bodyLength }
+    size_t message = builder.table({Field{0, 2, ARROW_METADATA_V5, false}, Field{1, 1, ARROW_HEADER_SCHEMA, false}, Field{2, 4, 0, true}, Field{3, 8, 0, false}}, slots);
+    builder.refer(0, message);
+    size_t schema_slot = slots[0];
+
+    /// Schema { fields: [Field] }
+    size_t schema = builder.table({Field{1, 4, 0, true}}, slots);
+    builder.refer(schema_slot, schema);
+    size_t fields_slot = slots[0];
+
+    size_t fields = builder.vector(1, 4);
+    builder.refer(fields_slot, fields);
+    size_t field_slot = builder.bytes.size();
+    builder.put<uint32_t>(0);
+
+    /// Field { name, nullable, type_type, type: Utf8, children: [] }, readers insist that children is present
+    size_t field = builder.table({Field{0, 4, 0, true}, Field{1, 1, 1, false}, Field{2, 1, ARROW_TYPE_UTF8, false}, Field{3, 4, 0, true}, Field{5, 4, 0, true}}, slots);
+    builder.refer(field_slot, field);
+    std::vector<size_t> field_slots = slots;
+    builder.refer(field_slots[0], builder.string(column_name));
+    builder.refer(field_slots[1], builder.table({}, slots));
+    builder.refer(field_slots[2], builder.vector(0, 4));
+    return arrow_message(builder);
+}
+
+/**
+ * The metadata of a record batch of one utf8 column, whose body is the offsets and then the data, each padded to 8
+ * bytes. There are no nulls, so the validity buffer is left empty.
+ */
+inline std::vector<uint8_t> arrow_record_batch_message(size_t row_count, size_t offsets_size, size_t data_size)
+{
+    typedef FlatbufferBuilder::Field Field;
+    size_t padded_offsets_size = (offsets_size + 7)/8*8;
+    size_t padded_data_size = (data_size + 7)/8*8;
+    FlatbufferBuilder builder;
+    std::vector<size_t> slots;
+
+    /// Message { version, header_type, header: RecordBatch, bodyLength }
+    size_t message = builder.table({Field{0, 2, ARROW_METADATA_V5, false}, Field{1, 1, ARROW_HEADER_RECORD_BATCH, false}, Field{2, 4, 0, true}, Field{3, 8, padded_offsets_size + padded_data_size, false}}, slots);
+    builder.refer(0, message);
+    size_t record_batch_slot = slots[0];
+
+    /// RecordBatch { length, nodes: [FieldNode], buffers: [Buffer] }
+    size_t record_batch = builder.table({Field{0, 8, row_count, false}, Field{1, 4, 0, true}, Field{2, 4, 0, true}}, slots);
+    builder.refer(record_batch_slot, record_batch);
+    std::vector<size_t> record_batch_slots = slots;
+
+    /// FieldNode { length, null_count }
+    builder.refer(record_batch_slots[0], builder.vector(1, 8));
+    builder.put<int64_t>(row_count);
+    builder.put<int64_t>(0);
+
+    /// Buffer { offset, length } for the validity, offsets and data buffers
+    builder.refer(record_batch_slots[1], builder.vector(3, 8));
+    builder.put<int64_t>(0);
+    builder.put<int64_t>(0);
+    builder.put<int64_t>(0);
+    builder.put<int64_t>(offsets_size);
+    builder.put<int64_t>(padded_offsets_size);
+    builder.put<int64_t>(data_size);
+    return arrow_message(builder);
+}
+
+/**
+ * The marker that ends an Arrow IPC stream.
+ */
+static const uint8_t ARROW_END_OF_STREAM[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0};
+
+/**
+ * The fields of a column collected for the next record batch.
+ * data holds the field contents back to back and offsets holds where each field ends, after a leading 0. Anything in
+ * data past the last offset belongs to a field that hasn't ended yet.
+ */
+class ArrowColumn
+{
+public:
+    std::vector<uint8_t> data;
+    std::vector<int32_t> offsets;
+
+    /**
+     * Record batches are cut once they hold about this much data or this many rows.
+     */
+    static const size_t BATCH_DATA_SIZE = 1024*1024;
+    static const size_t BATCH_ROW_COUNT = 64*1024;
+
+    ArrowColumn() : offsets(1, 0)
+    {
+    }
+
+    void add_data(const uint8_t* from_buffer, size_t copy_size)
+    {
+        data.insert(data.end(), from_buffer, from_buffer + copy_size);
+    }
+
+    void add_field(const uint8_t* from_buffer, size_t copy_size)
+    {
+        data.insert(data.end(), from_buffer, from_buffer + copy_size);
+        offsets.push_back(int32_t(data.size()));
+    }
+
+    void end_fields(size_t count)
+    {
+        offsets.insert(offsets.end(), count, int32_t(data.size()));
+    }
+
+    bool batch_full() const
+    {
+        return data.size() >= BATCH_DATA_SIZE || offsets.size() > BATCH_ROW_COUNT;
+    }
+
+    size_t row_count() const
+    {
+        return offsets.size() - 1;
+    }
+
+    /**
+     * Appends everything another column has collected, including any unfinished field at its end.
+     */
+    void append(const ArrowColumn& part)
+    {
+        int32_t base = int32_t(data.size());
+        data.insert(data.end(), part.data.begin(), part.data.end());
+        for(size_t i = 1; i < part.offsets.size(); i++)
+            offsets.push_back(base + part.offsets[i]);
+    }
+
+    /**
+     * Drops the finished fields once they have been written, keeping an unfinished field for the next batch.
+     */
+    void clear_batch()
+    {
+        data.erase(data.begin(), data.begin() + offsets.back());
+        offsets.assign(1, 0);
+    }
+};
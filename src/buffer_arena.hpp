@@ -0,0 +1,141 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Hands out page aligned buffers carved out of large regions of memory.
+ * Buffer sizes are rounded up to a power of two of at least a page, and each size has its own regions, so a buffer is
+ * always aligned to its size. The regions are huge page sized and aligned, and backed by huge pages where the system
+ * allows it, so a few TLB entries cover all of the column buffers. Buffers that are given back are reused for the same
+ * size, and all of the memory goes back to the system when the arena is destroyed. An arena is not thread safe,
+ * buffers should be allocated on one thread.
+ */
+class BufferArena
+{
+public:
+    BufferArena() : size_classes(SIZE_CLASS_COUNT)
+    {
+    }
+
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+
+    BufferArena(BufferArena&& other) noexcept : regions(std::move(other.regions)), size_classes(std::move(other.size_classes))
+    {
+        other.regions.clear();
+        other.size_classes.assign(SIZE_CLASS_COUNT, SizeClass());
+    }
+
+    ~BufferArena()
+    {
+        for(auto& region : regions)
+            munmap(region.first, region.second);
+    }
+
+    /**
+     * Gets a buffer of at least size bytes, size must not be more than MAX_BUFFER_SIZE.
+     */
+    uint8_t* allocate(size_t size)
+    {
+        SizeClass& size_class = size_classes[size_class_of(size)];
+        if(!size_class.free_buffers.empty())
+        {
+            uint8_t* buffer = size_class.free_buffers.back();
+            size_class.free_buffers.pop_back();
+            return buffer;
+        }
+
+        if(size_class.next == size_class.region_end)
+            add_region(size_class);
+        uint8_t* buffer = size_class.next;
+        size_class.next += class_size(size_class_of(size));
+        return buffer;
+    }
+
+    /**
+     * Gives a buffer back to be handed out again, size must be the size it was allocated with.
+     */
+    void release(uint8_t* buffer, size_t size)
+    {
+        if(buffer != nullptr)
+            size_classes[size_class_of(size)].free_buffers.push_back(buffer);
+    }
+
+    static const size_t SMALL_PAGE_SIZE = 4096;
+    static const size_t HUGE_PAGE_SIZE = 2*1024*1024; /// The usual x86-64 huge page size
+    static const size_t MAX_BUFFER_SIZE = HUGE_PAGE_SIZE;
+
+private:
+    static const size_t SIZE_CLASS_COUNT = 10; /// Powers of two from a page to a huge page
+
+    class SizeClass
+    {
+    public:
+        uint8_t* next = nullptr; /// The next unused buffer in the newest region of this size
+        uint8_t* region_end = nullptr;
+        std::vector<uint8_t*> free_buffers;
+    };
+
+    std::vector<std::pair<uint8_t*, size_t>> regions; /// The start and size of each mapping
+    std::vector<SizeClass> size_classes;
+
+    static size_t size_class_of(size_t size)
+    {
+        size_t size_class = 0;
+        while(class_size(size_class) < size)
+            size_class++;
+        return size_class;
+    }
+
+    static size_t class_size(size_t size_class)
+    {
+        return SMALL_PAGE_SIZE << size_class;
+    }
+
+    static size_t round_up(size_t size, size_t multiple)
+    {
+        return (size + multiple - 1)/multiple*multiple;
+    }
+
+    /**
+     * Gives a size class a fresh region to carve its buffers out of.
+     */
+    void add_region(SizeClass& size_class)
+    {
+        size_t region_size = HUGE_PAGE_SIZE;
+        void* mapping = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        /// Explicit huge pages only work if the administrator has reserved some, so this usually fails quickly
+        mapping = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if(mapping == MAP_FAILED)
+        {
+            /// Map an extra huge page worth so the region can be trimmed to a huge page boundary
+            size_t mapping_size = region_size + HUGE_PAGE_SIZE;
+            mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(mapping == MAP_FAILED)
+            {
+                perror("Error allocating buffers");
+                exit(1);
+            }
+            uint8_t* mapping_begin = static_cast<uint8_t*>(mapping);
+            uint8_t* aligned = reinterpret_cast<uint8_t*>(round_up(reinterpret_cast<uintptr_t>(mapping_begin), HUGE_PAGE_SIZE));
+            if(aligned != mapping_begin)
+                munmap(mapping_begin, aligned - mapping_begin);
+            if(aligned + region_size != mapping_begin + mapping_size)
+                munmap(aligned + region_size, mapping_begin + mapping_size - (aligned + region_size));
+            mapping = aligned;
+#ifdef MADV_HUGEPAGE
+            /// Ask for transparent huge pages, if there is an error, well we tried our best.
+            madvise(mapping, region_size, MADV_HUGEPAGE);
+#endif
+        }
+        regions.emplace_back(static_cast<uint8_t*>(mapping), region_size);
+        size_class.next = static_cast<uint8_t*>(mapping);
+        size_class.region_end = size_class.next + region_size;
+    }
+};
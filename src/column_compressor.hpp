@@ -0,0 +1,315 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/**
+ * How the column files are compressed. Each method is only there if its library was found when building.
+ */
+enum CompressionMethod
+{
+    NoCompression,
+    GzipCompression,
+    ZstdCompression,
+    Lz4Compression
+};
+
+class OutputCompression
+{
+public:
+    CompressionMethod method = NoCompression;
+    int level = 0; /// 0 for the method's default level
+
+    /**
+     * The suffix that goes after the column file's own extension, such as .zst.
+     */
+    const char* extension() const
+    {
+        static const char* extensions[] = {"", ".gz", ".zst", ".lz4"};
+        return extensions[method];
+    }
+
+    /**
+     * Whether the library for the method was built in.
+     */
+    bool available() const
+    {
+        switch(method)
+        {
+            case NoCompression:
+                return true;
+#ifdef HAVE_ZLIB
+            case GzipCompression:
+                return true;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdCompression:
+                return true;
+#endif
+#ifdef HAVE_LZ4
+            case Lz4Compression:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+};
+
+/**
+ * A streaming compressor for one column file. The column's output is fed through it a buffer at a time, and what it
+ * gives back is appended to the file. Each stream is a standard gzip member, zstd frame or lz4 frame, which the usual
+ * command line tools can read. Once a stream has been finished the compressor starts a new one for the next file.
+ * A compressor is only ever used by one thread at a time, the one writing its column.
+ */
+class ColumnCompressor
+{
+public:
+    explicit ColumnCompressor(const OutputCompression& compression) : method(compression.method)
+    {
+        switch(method)
+        {
+#ifdef HAVE_ZLIB
+            case GzipCompression:
+                /// A window of 2^15 bytes with 16 added asks for a gzip header and trailer rather than zlib's
+                zlib_stream = z_stream();
+                if(deflateInit2(&zlib_stream, compression.level == 0 ? Z_DEFAULT_COMPRESSION : compression.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                    fail("gzip", zlib_stream.msg);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdCompression:
+                zstd_context = ZSTD_createCCtx();
+                if(zstd_context == nullptr)
+                    fail("zstd", "out of memory");
+                check_zstd(ZSTD_CCtx_setParameter(zstd_context, ZSTD_c_compressionLevel, compression.level == 0 ? ZSTD_CLEVEL_DEFAULT : compression.level));
+                break;
+#endif
+#ifdef HAVE_LZ4
+            case Lz4Compression:
+                check_lz4(LZ4F_createCompressionContext(&lz4_context, LZ4F_VERSION));
+                lz4_preferences = LZ4F_preferences_t();
+                lz4_preferences.frameInfo.blockSizeID = LZ4F_max64KB;
+                lz4_preferences.compressionLevel = compression.level;
+                lz4_started = false;
+                break;
+#endif
+            default:
+                fail("the output", "the compression method was not built in");
+        }
+    }
+
+    ~ColumnCompressor()
+    {
+        switch(method)
+        {
+#ifdef HAVE_ZLIB
+            case GzipCompression:
+                deflateEnd(&zlib_stream);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdCompression:
+                ZSTD_freeCCtx(zstd_context);
+                break;
+#endif
+#ifdef HAVE_LZ4
+            case Lz4Compression:
+                LZ4F_freeCompressionContext(lz4_context);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    ColumnCompressor(const ColumnCompressor&) = delete;
+    ColumnCompressor& operator=(const ColumnCompressor&) = delete;
+
+    /**
+     * Feeds size bytes of column output into the stream, and gives back the compressed output that is ready. This may
+     * well be nothing, as the compressor holds on to input until it has a block's worth. The output is only valid
+     * until the next call.
+     */
+    const std::vector<uint8_t>& compress(const uint8_t* input, size_t size)
+    {
+        output.clear();
+        switch(method)
+        {
+#ifdef HAVE_ZLIB
+            case GzipCompression:
+                deflate_stream(input, size, Z_NO_FLUSH);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdCompression:
+                compress_zstd(input, size, ZSTD_e_continue);
+                break;
+#endif
+#ifdef HAVE_LZ4
+            case Lz4Compression:
+            {
+                begin_lz4();
+                size_t room = LZ4F_compressBound(size, &lz4_preferences);
+                uint8_t* destination = extend(room);
+                trim(room - check_lz4(LZ4F_compressUpdate(lz4_context, destination, room, input, size, nullptr)));
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+        return output;
+    }
+
+    /**
+     * Ends the stream, and gives back the rest of its compressed output. The next call starts a new stream.
+     */
+    const std::vector<uint8_t>& finish()
+    {
+        output.clear();
+        switch(method)
+        {
+#ifdef HAVE_ZLIB
+            case GzipCompression:
+                deflate_stream(nullptr, 0, Z_FINISH);
+                deflateReset(&zlib_stream);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdCompression:
+                compress_zstd(nullptr, 0, ZSTD_e_end);
+                break;
+#endif
+#ifdef HAVE_LZ4
+            case Lz4Compression:
+            {
+                begin_lz4(); /// An empty file is still a frame
+                size_t room = LZ4F_compressBound(0, &lz4_preferences);
+                uint8_t* destination = extend(room);
+                trim(room - check_lz4(LZ4F_compressEnd(lz4_context, destination, room, nullptr)));
+                lz4_started = false;
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+        return output;
+    }
+
+private:
+    CompressionMethod method;
+    std::vector<uint8_t> output; /// Reused for every call, so it soon stops being reallocated
+#ifdef HAVE_ZLIB
+    z_stream zlib_stream;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx* zstd_context;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_cctx* lz4_context;
+    LZ4F_preferences_t lz4_preferences;
+    bool lz4_started; /// Whether the current frame's header has been written
+#endif
+
+    static void fail(const char* what, const char* message)
+    {
+        fprintf(stderr, "Error compressing %s: %s\n", what, message != nullptr ? message : "unknown error");
+        exit(1);
+    }
+
+    /**
+     * Adds room bytes to the end of the output for a library to write into, and gives where they start.
+     */
+    uint8_t* extend(size_t room)
+    {
+        output.resize(output.size() + room);
+        return output.data() + output.size() - room;
+    }
+
+    /**
+     * Takes off the part of the room that was left unwritten.
+     */
+    void trim(size_t unused)
+    {
+        output.resize(output.size() - unused);
+    }
+
+#ifdef HAVE_ZLIB
+    void deflate_stream(const uint8_t* input, size_t size, int flush)
+    {
+        zlib_stream.next_in = const_cast<Bytef*>(input);
+        zlib_stream.avail_in = uInt(size);
+        while(true)
+        {
+            /// Done once all of the input is taken and deflate had room to spare, or the stream has ended
+            size_t room = std::max<size_t>(16*1024, size/2);
+            zlib_stream.next_out = extend(room);
+            zlib_stream.avail_out = uInt(room);
+            int result = deflate(&zlib_stream, flush);
+            trim(zlib_stream.avail_out);
+            if(result == Z_STREAM_ERROR)
+                fail("gzip", zlib_stream.msg);
+            if(flush == Z_FINISH ? result == Z_STREAM_END : zlib_stream.avail_in == 0 && zlib_stream.avail_out != 0)
+                break;
+        }
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    static size_t check_zstd(size_t result)
+    {
+        if(ZSTD_isError(result))
+            fail("zstd", ZSTD_getErrorName(result));
+        return result;
+    }
+
+    void compress_zstd(const uint8_t* input, size_t size, ZSTD_EndDirective directive)
+    {
+        ZSTD_inBuffer in_buffer = {input, size, 0};
+        while(true)
+        {
+            /// With e_end the return value is what is still to be flushed, otherwise all of the input has to be taken
+            size_t room = ZSTD_CStreamOutSize();
+            ZSTD_outBuffer out_buffer = {extend(room), room, 0};
+            size_t remaining = check_zstd(ZSTD_compressStream2(zstd_context, &out_buffer, &in_buffer, directive));
+            trim(room - out_buffer.pos);
+            if(directive == ZSTD_e_end ? remaining == 0 : in_buffer.pos == in_buffer.size)
+                break;
+        }
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    static size_t check_lz4(size_t result)
+    {
+        if(LZ4F_isError(result))
+            fail("lz4", LZ4F_getErrorName(result));
+        return result;
+    }
+
+    /**
+     * Writes the frame header, the first time the frame is given anything.
+     */
+    void begin_lz4()
+    {
+        if(lz4_started)
+            return;
+        uint8_t* destination = extend(LZ4F_HEADER_SIZE_MAX);
+        trim(LZ4F_HEADER_SIZE_MAX - check_lz4(LZ4F_compressBegin(lz4_context, destination, LZ4F_HEADER_SIZE_MAX, &lz4_preferences)));
+        lz4_started = true;
+    }
+#endif
+};
@@ -0,0 +1,301 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "field_boundaries.hpp"
+#include "type_inference.hpp"
+
+/**
+ * A 64 bit hash that can be fed a field in pieces, 8 bytes at a time.
+ */
+class StreamingHash
+{
+public:
+    void add(const uint8_t* bytes, size_t size)
+    {
+        length += size;
+        while(pending_size != 0 && size != 0)
+            add_pending_byte(*bytes++), size--;
+        for(; size >= 8; bytes += 8, size -= 8)
+        {
+            uint64_t word;
+            memcpy(&word, bytes, sizeof(word));
+            mix(word);
+        }
+        if(size != 0)
+        {
+            /// The tail starts a new word, as pending is empty by now
+            for(size_t i = 0; i < size; i++)
+                pending |= uint64_t(bytes[i]) << (8*i);
+            pending_size = unsigned(size);
+        }
+    }
+
+    /**
+     * Hashes a whole field, the same as adding it and finishing. A local hash stays in registers.
+     */
+    static uint64_t hash_field(const uint8_t* bytes, size_t size)
+    {
+        StreamingHash hash;
+        hash.add(bytes, size);
+        return hash.finish();
+    }
+
+    /**
+     * Hashes a field of less than 8 bytes that has already been loaded into the low bytes of word, with the bytes
+     * above it cleared. The same as hash_field.
+     */
+    static uint64_t hash_short_field(uint64_t word, size_t size)
+    {
+        StreamingHash hash;
+        hash.pending = word;
+        hash.pending_size = unsigned(size);
+        hash.length = size;
+        return hash.finish();
+    }
+
+    /**
+     * Gives the hash of everything added since the last call, and starts over.
+     */
+    uint64_t finish()
+    {
+        if(pending_size != 0)
+            mix(pending);
+        uint64_t hash = state ^ length;
+        *this = StreamingHash();
+
+        /// The finaliser of MurmurHash3, so every bit of the hash depends on every bit of the input
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        hash *= 0xC4CEB9FE1A85EC53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+private:
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint64_t pending = 0; /// Bytes that don't make up a whole word yet
+    unsigned pending_size = 0;
+    uint64_t length = 0;
+
+    void mix(uint64_t word)
+    {
+        state = (state ^ word)*0x9E3779B97F4A7C15ULL;
+        state ^= state >> 29;
+    }
+
+    void add_pending_byte(uint8_t byte)
+    {
+        pending |= uint64_t(byte) << (8*pending_size);
+        if(++pending_size == 8)
+        {
+            mix(pending);
+            pending = 0;
+            pending_size = 0;
+        }
+    }
+};
+
+/**
+ * Profiles a column from its output as it is flushed: how many fields and empty fields it has, the shortest and longest
+ * field, the range and sum of the fields that are numbers, and an estimate of how many distinct non-empty fields there
+ * are. Lengths include any quotes, as the fields are written out.
+ * The distinct estimate is a HyperLogLog with 2^HLL_PRECISION registers, 4K per column for about 1.6% standard error.
+ */
+class ColumnStatistics
+{
+public:
+    static const unsigned HLL_PRECISION = 12;
+
+    uint64_t count = 0;
+    uint64_t empty_count = 0;
+    uint64_t min_length = std::numeric_limits<uint64_t>::max();
+    uint64_t max_length = 0;
+    uint64_t numeric_count = 0;
+    double numeric_min = std::numeric_limits<double>::infinity();
+    double numeric_max = -std::numeric_limits<double>::infinity();
+    double numeric_sum = 0.0;
+
+    /**
+     * The output's fields are quoted with quote, or FieldBoundaries::NO_QUOTE if the columns are unquoted.
+     */
+    explicit ColumnStatistics(int quote = '"') : boundaries(quote), registers(size_t(1) << HLL_PRECISION, 0)
+    {
+    }
+
+    void scan(const uint8_t* ptr, size_t size)
+    {
+        const uint8_t* end = ptr + size;
+        while(ptr != end)
+        {
+            int64_t integer;
+            size_t integer_size;
+            if(boundaries.at_field_start() && end - ptr >= 8 && parse_short_digits(ptr, integer, integer_size) && integer_size != 0)
+            {
+                /// Most fields of a numeric column are short integers, they are parsed and hashed 8 bytes at a time
+                uint64_t word;
+                memcpy(&word, ptr, sizeof(word));
+                word &= ~uint64_t(0) >> (64 - 8*integer_size);
+                field_size = integer_size;
+                add_number(double(integer));
+                end_field(StreamingHash::hash_short_field(word, integer_size));
+                ptr += integer_size + 1;
+                continue;
+            }
+            
+            bool field_ended;
+            const uint8_t* piece_end = boundaries.next_piece(ptr, end, field_ended);
+            if(field_ended && field_size == 0)
+            {
+                /// The whole field is here, which is usual
+                add_field(ptr, piece_end - ptr);
+                ptr = piece_end + 1;
+                continue;
+            }
+
+            hash.add(ptr, piece_end - ptr);
+            if(field_size + (piece_end - ptr) <= MAX_TYPED_FIELD_SIZE)
+                partial.append(ptr, piece_end);
+            field_size += piece_end - ptr;
+            if(field_ended)
+            {
+                end_field(hash.finish());
+                ptr = piece_end + 1;
+            }
+            else
+            {
+                ptr = piece_end;
+            }
+        }
+    }
+
+    /**
+     * Adds a whole field.
+     */
+    void add_field(const uint8_t* field, size_t size)
+    {
+        field_size = size;
+        if(size <= MAX_TYPED_FIELD_SIZE)
+            check_number(field, size);
+        end_field(StreamingHash::hash_field(field, size));
+    }
+
+    /**
+     * Called after the last scan.
+     */
+    void finish()
+    {
+        if(boundaries.finish())
+            end_field(hash.finish());
+    }
+
+    /**
+     * Estimates the number of distinct non-empty fields from the registers, counting the empty registers instead for
+     * small counts where that is more accurate.
+     */
+    double distinct_estimate() const
+    {
+        double register_count = double(registers.size());
+        double inverse_sum = 0.0;
+        size_t empty_registers = 0;
+        for(uint8_t rank : registers)
+        {
+            inverse_sum += std::ldexp(1.0, -rank);
+            empty_registers += rank == 0;
+        }
+        double alpha = 0.7213/(1.0 + 1.079/register_count);
+        double estimate = alpha*register_count*register_count/inverse_sum;
+        if(estimate <= 2.5*register_count && empty_registers != 0)
+            estimate = register_count*std::log(register_count/empty_registers);
+        return estimate;
+    }
+
+private:
+    FieldBoundaries boundaries;
+    StreamingHash hash;
+    std::vector<uint8_t> registers;
+    uint64_t field_size = 0; /// How much of the current field has been scanned
+    std::string partial; /// The start of a field cut off at the end of the last scan, if it could be a number
+
+    void check_number(const uint8_t* field, size_t size)
+    {
+        double value;
+        if(!parse_short_decimal(field, size, value))
+        {
+            if(!is_double(field, size))
+                return;
+            value = parse_double(field, size);
+            if(!std::isfinite(value))
+                return;
+        }
+        add_number(value);
+    }
+
+    void add_number(double value)
+    {
+        numeric_count++;
+        numeric_min = std::min(numeric_min, value);
+        numeric_max = std::max(numeric_max, value);
+        numeric_sum += value;
+    }
+
+    /**
+     * Checks and parses a field in one pass if it is a decimal of up to 15 digits with no exponent, which covers most
+     * numeric columns. Returns false for anything else, which may still be a number.
+     */
+    static bool parse_short_decimal(const uint8_t* field, size_t size, double& value)
+    {
+        static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+        const uint8_t* end = field + size;
+        bool negative = size != 0 && *field == '-';
+        if(size != 0 && (*field == '-' || *field == '+'))
+            field++;
+        uint64_t mantissa = 0;
+        int digit_count = 0;
+        int fraction_digits = 0;
+        for(; field != end && is_ascii_digit(*field); field++, digit_count++)
+            mantissa = mantissa*10 + (*field - '0');
+        if(field != end && *field == '.')
+        {
+            for(field++; field != end && is_ascii_digit(*field); field++, fraction_digits++)
+                mantissa = mantissa*10 + (*field - '0');
+        }
+        digit_count += fraction_digits;
+        if(field != end || digit_count == 0 || digit_count > 15)
+            return false;
+        value = fraction_digits == 0 ? double(mantissa) : double(mantissa)/powers_of_ten[fraction_digits];
+        value = negative ? -value : value;
+        return true;
+    }
+
+    void end_field(uint64_t field_hash)
+    {
+        count++;
+        min_length = std::min(min_length, field_size);
+        max_length = std::max(max_length, field_size);
+        if(!partial.empty())
+        {
+            if(field_size <= MAX_TYPED_FIELD_SIZE)
+                check_number(reinterpret_cast<const uint8_t*>(partial.data()), partial.size());
+            partial.clear();
+        }
+
+        if(field_size == 0)
+        {
+            empty_count++;
+        }
+        else
+        {
+            /// The top bits pick a register, which keeps the longest run of leading zeros seen in the rest
+            size_t index = field_hash >> (64 - HLL_PRECISION);
+            uint8_t rank = uint8_t(__builtin_clzll((field_hash << HLL_PRECISION) | (uint64_t(1) << (HLL_PRECISION - 1))) + 1);
+            if(rank > registers[index])
+                registers[index] = rank;
+        }
+        field_size = 0;
+    }
+};
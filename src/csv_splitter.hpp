@@ -1,16 +1,45 @@
-#include <alloca.h>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cctype>
 #include <cinttypes>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <thread>
 #include <type_traits>
+#include <utility>
 #include <vector>
+#include "arrow_writer.hpp"
+#include "buffer_arena.hpp"
+#include "column_compressor.hpp"
+#include "column_statistics.hpp"
+#include "csv_tokenizer.hpp"
+#include "dialect.hpp"
+#include "field_unquoter.hpp"
+#include "input_decompressor.hpp"
+#include "ring_buffer.hpp"
+#include "row_partitioning.hpp"
+#include "row_selection.hpp"
+#include "structural_index.hpp"
+#include "type_inference.hpp"
+#ifdef HAVE_LIBURING
+#include "uring_writer.hpp"
+#else
+class UringWriter; /// Never created without liburing
+#endif
 
 /** 
  * ~16K byte buffer sizes, this can have an impact on performance.
@@ -18,91 +47,647 @@
 static const size_t BUFFER_SIZE = 16*1024; 
 
 /**
- * We would like to prefer stack memory if possible. 
- * This method says whether we need to use the heap, because our buffer size is too large.
- * If 90% of the stack size is smaller than the two buffers, use the heap.
+ * Writes all of a buffer to a file, carrying on after short writes.
  */
-bool should_use_heap(size_t number_of_chars)
+void write_all(int output_fd, const uint8_t* from_buffer, size_t write_size)
 {
-    static const size_t required_stack = sizeof(uint8_t)*number_of_chars;
-    struct rlimit rlimit_info;
-    int result = getrlimit(RLIMIT_STACK, &rlimit_info);
-    if (result == 0)
+    while(write_size != 0)
     {
-        size_t available_stack = (9*rlimit_info.rlim_cur)/10;
-        return available_stack < required_stack;
+        auto write_result = write(output_fd, from_buffer, write_size);
+        if(write_result == -1)
+        {
+            perror("Error writing file");
+            exit(1);
+        }
+        from_buffer += write_result;
+        write_size -= write_result;
     }
-    else
+}
+
+void write_all(int output_fd, const std::vector<uint8_t>& output)
+{
+    write_all(output_fd, output.data(), output.size());
+}
+
+/**
+ * Hands full column buffers to writer threads, so that the parser does not wait on write() or on compression.
+ * Each column is written by one of the writers, picked by its index, so writes to the same file are done in the order
+ * they were queued. A writer hands each buffer back once it has been written, to be swapped into the next column that
+ * it writes. Files can be closed through the queue too, after the writes queued before. Compressed columns are
+ * compressed by their writer, so with several writers different columns are compressed at the same time. The parser
+ * asks for a buffer of the size the column wants, and a written buffer of another size is swapped for one from the
+ * arena on the parser thread, since the arena is not thread safe.
+ */
+class WriteQueue
+{
+public:
+    class WriteRequest
+    {
+    public:
+        int output_fd;
+        uint8_t* buffer; /// nullptr tells the writer to close output_fd, or to stop if output_fd is -1
+        size_t size;
+        size_t capacity; /// The size the buffer was allocated with
+        ColumnCompressor* compressor; /// If set, the output goes through it, and its stream is ended before a close
+    };
+    
+    class SpareBuffer
+    {
+    public:
+        uint8_t* buffer;
+        size_t capacity;
+    };
+    
+    /**
+     * A writer thread, with the requests queued for it and the buffers it has finished with.
+     */
+    class Writer
+    {
+    public:
+        RingBuffer<WriteRequest> requests;
+        RingBuffer<SpareBuffer> spare_buffers; /// Buffers the writer has finished with
+        std::vector<SpareBuffer> free_buffers; /// Buffers taken back from the writer but not handed out yet
+        std::thread thread;
+        
+        explicit Writer(size_t depth) : requests(depth), spare_buffers(depth)
+        {
+        }
+    };
+    
+    BufferArena& arena;
+    std::vector<std::unique_ptr<Writer>> writers;
+    size_t held_size; /// Bytes of buffers owned by the queue, waiting to be written or spare
+    
+    /**
+     * depth is the number of buffers from the arena that can be waiting to be written by each writer.
+     */
+    WriteQueue(size_t depth, BufferArena& arena, size_t writer_count = 1) : arena(arena), held_size(writer_count*depth*BUFFER_SIZE)
+    {
+        for(size_t i = 0; i < writer_count; i++)
+        {
+            writers.emplace_back(new Writer(depth));
+            Writer& writer = *writers.back();
+            for(size_t j = 0; j < depth; j++)
+                writer.spare_buffers.push(SpareBuffer{arena.allocate(BUFFER_SIZE), BUFFER_SIZE});
+            writer.thread = std::thread([&writer]()
+            {
+                while(true)
+                {
+                    WriteRequest request = writer.requests.pop();
+                    if(request.buffer == nullptr && request.output_fd == -1)
+                    {
+                        break;
+                    }
+                    else if(request.buffer == nullptr)
+                    {
+                        if(request.compressor != nullptr)
+                            write_all(request.output_fd, request.compressor->finish());
+                        close(request.output_fd);
+                        continue;
+                    }
+                    
+                    if(request.compressor != nullptr)
+                        write_all(request.output_fd, request.compressor->compress(request.buffer, request.size));
+                    else
+                        write_all(request.output_fd, request.buffer, request.size);
+                    writer.spare_buffers.push(SpareBuffer{request.buffer, request.capacity});
+                }
+            });
+        }
+    }
+    
+    /**
+     * Queues size bytes in buffer to be written to the file of the column_index'th column, and gives back an empty
+     * buffer of capacity bytes in its place.
+     */
+    SpareBuffer write(size_t column_index, const WriteRequest& request, size_t capacity)
+    {
+        Writer& writer = *writers[column_index % writers.size()];
+        writer.requests.push(request);
+        SpareBuffer spare;
+        while(writer.spare_buffers.try_pop(spare))
+            writer.free_buffers.push_back(spare);
+        if(writer.free_buffers.empty())
+        {
+            /// Every buffer is being written, wait for one to come back
+            writer.free_buffers.push_back(writer.spare_buffers.pop());
+        }
+        
+        auto match = std::find_if(writer.free_buffers.begin(), writer.free_buffers.end(), [capacity](const SpareBuffer& buffer)
+        {
+            return buffer.capacity == capacity;
+        });
+        if(match == writer.free_buffers.end())
+        {
+            /// Swap a buffer of the wrong size for one of the right size, rather than have the column resize it
+            match = writer.free_buffers.begin();
+            arena.release(match->buffer, match->capacity);
+            match->buffer = arena.allocate(capacity);
+            match->capacity = capacity;
+        }
+        spare = *match;
+        *match = writer.free_buffers.back();
+        writer.free_buffers.pop_back();
+        held_size += request.capacity - spare.capacity;
+        return spare;
+    }
+    
+    /**
+     * Closes the column_index'th column's file once everything queued for it has been written, ending its compressed
+     * stream first if it has one.
+     */
+    void close_file(size_t column_index, int output_fd, ColumnCompressor* compressor)
+    {
+        writers[column_index % writers.size()]->requests.push(WriteRequest{output_fd, nullptr, 0, 0, compressor});
+    }
+    
+    /**
+     * Waits for all of the queued writes to finish, the queue can't be used afterwards.
+     */
+    void finish()
     {
-        /// Failed to get info, use the heap
-        return true;
+        for(auto& writer : writers)
+            writer->requests.push(WriteRequest{-1, nullptr, 0, 0, nullptr});
+        for(auto& writer : writers)
+        {
+            writer->thread.join();
+            SpareBuffer spare;
+            while(writer->spare_buffers.try_pop(spare))
+                writer->free_buffers.push_back(spare);
+            for(auto& buffer : writer->free_buffers)
+                arena.release(buffer.buffer, buffer.capacity);
+            writer->free_buffers.clear();
+        }
+        held_size = 0;
     }
+};
+
+class BoundedMemory;
+class BufferBudget;
+
+class ColumnInfo
+{
+public:
+    bool skipped; /// If set the column was not selected, it has no buffer or file and everything added to it is dropped
+    int output_fd; /// -1 if the column is kept in memory, or if its file is closed in bounded memory mode
+    WriteQueue* write_queue; /// If set, writes are done on the writer thread
+    UringWriter* uring_writer; /// If set, writes are queued on an io_uring instead
+    BoundedMemory* bounded_memory; /// If set, the buffer is borrowed from a shared slab and the file may be closed
+    BufferBudget* buffer_budget; /// If set, the buffer is resized to suit how much output the column gets
+    size_t target_size; /// The buffer size the budget would like the column to have
+    size_t epoch_output; /// Bytes flushed since the budget last looked at the column
+    uint64_t file_offset; /// Where the next write goes in the file, io_uring writes need it
+    size_t column_index; /// Where the column is in the split's column list
+    size_t shard; /// Which of the column's files is being written, when each file only holds a set number of rows
+    std::list<size_t>::iterator open_file_position; /// Where the column is in the open file pool, if its file is open
+    uint8_t* buffer; /// nullptr if a column in bounded memory mode has had its buffer spilled
+    size_t buffer_size;
+    size_t buffer_position;
+    std::vector<uint8_t> pending; /// Flushed output of an in-memory column that has not been written to a file yet
+    std::unique_ptr<ArrowColumn> arrow; /// If set, the fields are collected into Arrow record batches instead of the buffer
+    std::unique_ptr<TypeInference> type_inference; /// If set, the column's type is inferred from its output
+    std::unique_ptr<ColumnStatistics> statistics; /// If set, the column is profiled from its output
+    std::unique_ptr<FieldUnquoter> unquoter; /// If set, the column gets the values of its fields rather than their input
+    std::unique_ptr<ColumnCompressor> compressor; /// If set, the column's file is compressed
+};
+
+/**
+ * The bytes of a file name that a header name leaves free, for a _N suffix added to tell apart repeated names and for
+ * the suffixes of the column file.
+ */
+static const size_t COLUMN_NAME_RESERVE = 48;
+
+/**
+ * Called with everything a column writes out, before it goes to the file.
+ */
+inline void inspect_output(ColumnInfo& column, const uint8_t* output, size_t output_size)
+{
+    if(column.type_inference != nullptr)
+        column.type_inference->scan(output, output_size);
+    if(column.statistics != nullptr)
+        column.statistics->scan(output, output_size);
 }
 
 /**
- * Use malloc if we have to, otherwise use alloca for the stack.
- * This has to be a macro for alloca
+ * Gives the name of the file for the column_index'th column. Columns named by a header use their name, otherwise the
+ * files are numbered from 1.
  */
-#define ALLOCATE_BUFFER(use_heap, buffer, sz) \
-if(use_heap)\
-    buffer = static_cast<uint8_t*>(malloc(sz));\
-else\
-    buffer = static_cast<uint8_t*>(alloca(sz));\
+std::string column_file_name(const std::string& name, const std::vector<std::string>& column_names, size_t column_index, const char* extension = ".csv")
+{
+    if(column_index < column_names.size())
+        return name + column_names[column_index] + extension;
     
+    char id_buffer[24];
+    sprintf(id_buffer, "%03zu", column_index + 1);
+    return name + std::string(id_buffer) + extension;
+}
+
+static const size_t NO_BLOCK_OWNER = ~size_t(0); /// Marks a slab block that no column holds
+
+/**
+ * Gives the name of the file a column is writing. If the rows are split between files, the column's shard is numbered
+ * before the extension, as in <prefix>003.part0007.csv.
+ */
+std::string column_file_name(const std::string& name, const std::vector<std::string>& column_names, const ColumnInfo& column, bool sharded, const char* extension = ".csv")
+{
+    if(!sharded)
+        return column_file_name(name, column_names, column.column_index, extension);
     
+    char shard_buffer[32];
+    snprintf(shard_buffer, sizeof(shard_buffer), ".part%04zu", column.shard);
+    return column_file_name(name, column_names, column.column_index, (shard_buffer + std::string(extension)).c_str());
+}
+
 /**
- * Create column info for a fresh column.
- * This has to be a macro for alloca
- * TODO: More error handling.
+ * Keeps the column buffers and open column files within fixed limits, for inputs with so many columns that a private
+ * buffer and file for each would not fit.
+ * The buffers are equal sized blocks carved out of one slab. A column holds a block while it has output waiting, and
+ * when the slab runs out the columns holding the most output are spilled to their files to free up their blocks. The
+ * column files are kept in a least recently used pool of open files that stays below RLIMIT_NOFILE, and a file that
+ * was closed is reopened for appending.
  */
-#define CREATE_COLUMN_INFO(info, fname, id) \
-static char id_buffer[24];\
-sprintf(id_buffer, "%03zu", id);\
-info.output_fd = open((fname + std::string(id_buffer) + ".csv").c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);\
-if(info.output_fd == -1)\
-{\
-    perror("Error opening file for writing");\
-    exit(1);\
-}\
-info.buffer_position = 0;\
-info.buffer_size = BUFFER_SIZE;\
-info.on_heap = should_use_heap(BUFFER_SIZE);\
-ALLOCATE_BUFFER(info.on_heap, info.buffer, BUFFER_SIZE);
+class BoundedMemory
+{
+public:
+    /**
+     * max_memory is the size of the slab that the column buffers share. If sharded is set each column is written to a
+     * series of files, named by the column's shard.
+     */
+    BoundedMemory(std::vector<ColumnInfo>& column_infos, std::string name, const std::vector<std::string>& column_names, size_t max_memory, bool sharded = false) : column_infos(column_infos), name(name), column_names(column_names), sharded(sharded)
+    {
+        /// Small blocks let more columns hold output at once, large blocks make for fewer writes
+        block_size = std::min(BUFFER_SIZE, std::max<size_t>(4096, (max_memory/1024) & ~size_t(4095)));
+        size_t block_count = std::max<size_t>(16, max_memory/block_size);
+        slab_size = block_count*block_size;
+        void* mapping = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapping == MAP_FAILED)
+        {
+            perror("Error allocating column buffers");
+            exit(1);
+        }
+        slab = static_cast<uint8_t*>(mapping);
+        block_owners.resize(block_count, NO_BLOCK_OWNER);
+        for(size_t i = block_count; i-- != 0;)
+            free_blocks.push_back(slab + i*block_size);
+        
+        /// Leave some descriptors for the input and anything else the process has open
+        struct rlimit rlimit_info;
+        max_open_files = 1024;
+        if(getrlimit(RLIMIT_NOFILE, &rlimit_info) == 0 && rlimit_info.rlim_cur != RLIM_INFINITY)
+            max_open_files = rlimit_info.rlim_cur;
+        max_open_files = max_open_files > 32 ? max_open_files - 16 : 16;
+    }
+    
+    ~BoundedMemory()
+    {
+        munmap(slab, slab_size);
+    }
+    
+    /**
+     * Creates the file for a new column, which is left open as the most recently used.
+     */
+    void create_file(ColumnInfo& column)
+    {
+        open_file(column, O_CREAT | O_TRUNC);
+    }
+    
+    /**
+     * Writes out what is in the column's buffer, and gives the column a buffer if it has none.
+     */
+    void flush(ColumnInfo& column)
+    {
+        if(column.buffer_position != 0)
+            write_all(open_file(column, O_APPEND), column.buffer, column.buffer_position);
+        column.buffer_position = 0;
+        if(column.buffer == nullptr)
+        {
+            if(free_blocks.empty())
+                spill();
+            column.buffer = free_blocks.back();
+            column.buffer_size = block_size;
+            free_blocks.pop_back();
+            block_owners[(column.buffer - slab)/block_size] = column.column_index;
+        }
+    }
+    
+    /**
+     * Writes out what the column holds and closes its file, then creates the file for the column's next shard.
+     */
+    void next_file(ColumnInfo& column)
+    {
+        if(column.buffer != nullptr)
+            release_block(column);
+        if(column.output_fd != -1)
+        {
+            close(column.output_fd);
+            column.output_fd = -1;
+            open_files.erase(column.open_file_position);
+        }
+        column.shard++;
+        create_file(column);
+    }
+    
+    /**
+     * Writes out every column that still has output in the slab and closes all of the files.
+     */
+    void finish()
+    {
+        for(size_t owner : block_owners)
+        {
+            if(owner != NO_BLOCK_OWNER)
+                release_block(column_infos[owner]);
+        }
+        for(size_t open_column : open_files)
+        {
+            close(column_infos[open_column].output_fd);
+            column_infos[open_column].output_fd = -1;
+        }
+        open_files.clear();
+    }
+    
+private:
+    std::vector<ColumnInfo>& column_infos;
+    std::string name;
+    const std::vector<std::string>& column_names;
+    bool sharded;
+    uint8_t* slab;
+    size_t slab_size;
+    size_t block_size;
+    std::vector<uint8_t*> free_blocks;
+    std::vector<size_t> block_owners; /// The index of the column holding each block, or NO_BLOCK_OWNER
+    std::list<size_t> open_files; /// Columns with an open file, the most recently used first
+    size_t max_open_files;
+    
+    /**
+     * Gets an open file for the column, closing the least recently used file if the pool is full.
+     */
+    int open_file(ColumnInfo& column, int flags)
+    {
+        if(column.output_fd != -1)
+        {
+            open_files.splice(open_files.begin(), open_files, column.open_file_position);
+            return column.output_fd;
+        }
+        
+        if(open_files.size() >= max_open_files)
+        {
+            ColumnInfo& least_recent = column_infos[open_files.back()];
+            close(least_recent.output_fd);
+            least_recent.output_fd = -1;
+            open_files.pop_back();
+        }
+        
+        column.output_fd = open(column_file_name(name, column_names, column, sharded).c_str(), O_WRONLY | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if(column.output_fd == -1)
+        {
+            perror("Error opening file for writing");
+            exit(1);
+        }
+        open_files.push_front(column.column_index);
+        column.open_file_position = open_files.begin();
+        return column.output_fd;
+    }
+    
+    /**
+     * Writes out a column's buffer and hands its block back to the slab.
+     */
+    void release_block(ColumnInfo& column)
+    {
+        inspect_output(column, column.buffer, column.buffer_position);
+        if(column.buffer_position != 0)
+            write_all(open_file(column, O_APPEND), column.buffer, column.buffer_position);
+        block_owners[(column.buffer - slab)/block_size] = NO_BLOCK_OWNER;
+        free_blocks.push_back(column.buffer);
+        column.buffer = nullptr;
+        column.buffer_size = 0;
+        column.buffer_position = 0;
+    }
+    
+    /**
+     * Frees up a quarter of the slab, taken from the columns with the most output waiting.
+     * Doing this in batches means the sort is paid for once every few hundred blocks, rather than on every block.
+     */
+    void spill()
+    {
+        std::vector<size_t> owners(block_owners);
+        size_t spill_count = std::max<size_t>(1, owners.size()/4);
+        std::nth_element(owners.begin(), owners.begin() + (spill_count - 1), owners.end(), [this](size_t a, size_t b)
+        {
+            return column_infos[a].buffer_position > column_infos[b].buffer_position;
+        });
+        for(size_t i = 0; i < spill_count; i++)
+            release_block(column_infos[owners[i]]);
+    }
+};
 
 /**
- * Checks for the existence of a column.
- * This has to be a macro for alloca.
+ * The smallest and largest column buffers the buffer budget gives out.
  */
-#define CHECK_AND_CREATE_COLUMN \
-if(__builtin_expect(current_column == column_infos.size(), 0))\
-{\
-    column_infos.resize(column_infos.size() + 1);\
-    ColumnInfo& info = column_infos.back();\
-    CREATE_COLUMN_INFO(info, name, column_infos.size());\
-    add_chars_to_column(info, '\n', current_row);\
-}
+static const size_t MIN_COLUMN_BUFFER_SIZE = 4*1024;
+static const size_t MAX_COLUMN_BUFFER_SIZE = 1024*1024;
 
+/**
+ * The total size of the column buffers that the buffer budget aims for.
+ */
+static const size_t COLUMN_BUFFER_BUDGET = 64*1024*1024;
 
-class ColumnInfo
+/**
+ * Sizes each column's buffer by how much output it gets, within an overall budget for all of the column buffers.
+ * After every quarter of the budget's worth of output, each column's share of that output decides its share of the
+ * budget, rounded down to a power of two between MIN_COLUMN_BUFFER_SIZE and MAX_COLUMN_BUFFER_SIZE. Busy columns then
+ * flush in large writes, and columns that hardly get any output keep small buffers. A column moves to a larger buffer
+ * the next time it flushes, and to a smaller one straight away if what it holds fits. Buffers held by a write queue,
+ * waiting to be written or spare, come out of the budget first. The queue hands a flushed column a buffer of its target
+ * size, so the budget only has to resize a buffer when the target changes.
+ */
+class BufferBudget
 {
 public:
-    int output_fd;
-    uint8_t* buffer;
-    size_t buffer_size;
-    size_t buffer_position;
-    bool on_heap;
+    /**
+     * queued_size is the bytes of buffers held by the write queue, or nullptr if writes are not queued.
+     */
+    BufferBudget(std::vector<ColumnInfo>& column_infos, BufferArena& arena, size_t budget, const size_t* queued_size) : column_infos(column_infos), arena(arena), budget(budget), queued_size(queued_size), epoch_output(0)
+    {
+    }
+    
+    /**
+     * Called once a column has flushed flushed_size bytes and its buffer is empty.
+     */
+    void flushed(ColumnInfo& column, size_t flushed_size)
+    {
+        column.epoch_output += flushed_size;
+        epoch_output += flushed_size;
+        if(epoch_output >= budget/4)
+            rebalance();
+        if(column.buffer_size != column.target_size)
+            resize(column);
+    }
+    
+private:
+    std::vector<ColumnInfo>& column_infos;
+    BufferArena& arena;
+    size_t budget;
+    const size_t* queued_size;
+    size_t epoch_output; /// Bytes flushed by all of the columns since the last rebalance
+    
+    void rebalance()
+    {
+        size_t column_budget = budget;
+        if(queued_size != nullptr)
+            column_budget = *queued_size < budget ? budget - *queued_size : 0;
+        for(auto& column : column_infos)
+        {
+            size_t share = size_t(double(column_budget)*column.epoch_output/epoch_output);
+            column.target_size = MIN_COLUMN_BUFFER_SIZE;
+            while(column.target_size*2 <= share && column.target_size < MAX_COLUMN_BUFFER_SIZE)
+                column.target_size *= 2;
+            column.epoch_output = 0;
+            
+            /// Give back memory now, rather than waiting for a column that may not flush again for a long time
+            if(column.target_size < column.buffer_size && column.buffer_position <= column.target_size)
+                resize(column);
+        }
+        epoch_output = 0;
+    }
+    
+    void resize(ColumnInfo& column)
+    {
+        uint8_t* buffer = arena.allocate(column.target_size);
+        memcpy(buffer, column.buffer, column.buffer_position);
+        arena.release(column.buffer, column.buffer_size);
+        column.buffer = buffer;
+        column.buffer_size = column.target_size;
+    }
 };
 
+/**
+ * Writes the finished fields of an Arrow column to its file as a record batch, the offsets followed by the data.
+ * Columns that are kept in memory hold on to their fields until they are appended to a column with a file.
+ */
+void write_arrow_batch(ColumnInfo& column)
+{
+    ArrowColumn& arrow = *column.arrow;
+    if(column.output_fd == -1 || arrow.row_count() == 0)
+        return;
+    
+    static const uint8_t padding[8] = {};
+    size_t offsets_size = arrow.offsets.size()*sizeof(int32_t);
+    size_t data_size = arrow.offsets.back();
+    if(column.statistics != nullptr)
+    {
+        for(size_t i = 0; i < arrow.row_count(); i++)
+            column.statistics->add_field(arrow.data.data() + arrow.offsets[i], arrow.offsets[i + 1] - arrow.offsets[i]);
+    }
+    std::vector<uint8_t> message = arrow_record_batch_message(arrow.row_count(), offsets_size, data_size);
+    write_all(column.output_fd, message.data(), message.size());
+    write_all(column.output_fd, reinterpret_cast<const uint8_t*>(arrow.offsets.data()), offsets_size);
+    write_all(column.output_fd, padding, (8 - offsets_size%8)%8);
+    write_all(column.output_fd, arrow.data.data(), data_size);
+    write_all(column.output_fd, padding, (8 - data_size%8)%8);
+    arrow.clear_batch();
+}
+
+/**
+ * Writes output to the column's file from this thread, through its compressor if it has one.
+ */
+void write_to_file(ColumnInfo& column, const uint8_t* output, size_t output_size)
+{
+    if(column.compressor != nullptr)
+        write_all(column.output_fd, column.compressor->compress(output, output_size));
+    else
+        write_all(column.output_fd, output, output_size);
+}
+
+/**
+ * Ends a column's file and closes it. While the writer is running the file is closed by the writer, after the writes
+ * queued for it.
+ */
+void close_column_file(ColumnInfo& column, bool writer_running = true)
+{
+    if(column.arrow != nullptr)
+        write_all(column.output_fd, ARROW_END_OF_STREAM, sizeof(ARROW_END_OF_STREAM));
+    if(column.write_queue != nullptr && writer_running)
+    {
+        column.write_queue->close_file(column.column_index, column.output_fd, column.compressor.get());
+        return;
+    }
+    
+    if(column.compressor != nullptr)
+        write_all(column.output_fd, column.compressor->finish());
+    close(column.output_fd);
+}
+
 void flush_buffer(ColumnInfo& column)
 {
-    ssize_t remaining_count = column.buffer_position;
-    auto write_result = write(column.output_fd, column.buffer, remaining_count);
-    assert(write_result == remaining_count);
+    if(column.skipped)
+    {
+        return;
+    }
+    else if(column.arrow != nullptr)
+    {
+        write_arrow_batch(column);
+        return;
+    }
+    
+    inspect_output(column, column.buffer, column.buffer_position);
+    if(column.bounded_memory != nullptr)
+    {
+        column.bounded_memory->flush(column);
+        return;
+    }
+    else if(column.output_fd == -1)
+    {
+        column.pending.insert(column.pending.end(), column.buffer, column.buffer + column.buffer_position);
+    }
+    else if(column.write_queue != nullptr)
+    {
+        /// Swap in a spare buffer while this one is written
+        if(column.buffer_position != 0)
+        {
+            WriteQueue::WriteRequest request{column.output_fd, column.buffer, column.buffer_position, column.buffer_size, column.compressor.get()};
+            WriteQueue::SpareBuffer spare = column.write_queue->write(column.column_index, request, column.target_size);
+            column.buffer = spare.buffer;
+            column.buffer_size = spare.capacity;
+        }
+    }
+#ifdef HAVE_LIBURING
+    else if(column.uring_writer != nullptr)
+    {
+        /// Swap in a spare buffer while this one is written
+        if(column.buffer_position != 0)
+        {
+            column.uring_writer->queue_write(column.output_fd, column.buffer, column.buffer_size, column.buffer_position, column.file_offset, column.target_size);
+            column.file_offset += column.buffer_position;
+        }
+    }
+#endif
+    else
+    {
+        write_to_file(column, column.buffer, column.buffer_position);
+    }
+    size_t flushed_size = column.buffer_position;
     column.buffer_position = 0; /// Have to make sure we reset the position on the buffer.
+    if(column.buffer_budget != nullptr)
+        column.buffer_budget->flushed(column, flushed_size);
 }
 
-void add_buffer_to_column(ColumnInfo& column, uint8_t* from_buffer, size_t copy_size)
+/**
+ * Copies output into a column, after any unquoting.
+ */
+void copy_to_column(ColumnInfo& column, const uint8_t* from_buffer, size_t copy_size)
 {
+    if(column.skipped)
+    {
+        return;
+    }
+    else if(__builtin_expect(column.arrow != nullptr, 0))
+    {
+        column.arrow->add_data(from_buffer, copy_size);
+        return;
+    }
+    else if(__builtin_expect(column.buffer == nullptr, 0))
+        flush_buffer(column); /// The column was spilled in bounded memory mode, get it a buffer back
+    
     size_t remaining_buffer = column.buffer_size - column.buffer_position;
     while(copy_size >= remaining_buffer)
     {
@@ -127,8 +712,67 @@ void add_buffer_to_column(ColumnInfo& column, uint8_t* from_buffer, size_t copy_
     }
 }
 
+/**
+ * Where an unquoter sends a column's values.
+ */
+class ColumnOutput
+{
+public:
+    ColumnInfo& column;
+    
+    void operator()(const uint8_t* from_buffer, size_t copy_size)
+    {
+        copy_to_column(column, from_buffer, copy_size);
+    }
+};
+
+void add_buffer_to_column(ColumnInfo& column, const uint8_t* from_buffer, size_t copy_size)
+{
+    if(__builtin_expect(column.unquoter != nullptr, 0))
+    {
+        ColumnOutput output{column};
+        column.unquoter->add(from_buffer, copy_size, output);
+        return;
+    }
+    copy_to_column(column, from_buffer, copy_size);
+}
+
 void add_chars_to_column(ColumnInfo& column, uint8_t chr, size_t copy_size)
 {
+    if(column.skipped)
+    {
+        return;
+    }
+    else if(__builtin_expect(column.unquoter != nullptr, 0) && copy_size != 0)
+    {
+        /// A newline added on its own always ends a field, any other character is part of one
+        if(chr != '\n')
+        {
+            for(size_t i = 0; i < copy_size; i++)
+                add_buffer_to_column(column, &chr, 1);
+            return;
+        }
+        column.unquoter->end_field();
+    }
+    
+    if(__builtin_expect(column.arrow != nullptr, 0))
+    {
+        /// A newline added on its own always ends a field, newlines inside quoted fields come with the field's data
+        if(chr == '\n')
+        {
+            column.arrow->end_fields(copy_size);
+            if(column.arrow->batch_full())
+                write_arrow_batch(column);
+        }
+        else
+        {
+            column.arrow->data.insert(column.arrow->data.end(), copy_size, chr);
+        }
+        return;
+    }
+    else if(__builtin_expect(column.buffer == nullptr, 0))
+        flush_buffer(column); /// The column was spilled in bounded memory mode, get it a buffer back
+    
     size_t remaining_buffer = column.buffer_size - column.buffer_position;
     
     if(column.buffer_position + copy_size <= column.buffer_size)
@@ -143,389 +787,1640 @@ void add_chars_to_column(ColumnInfo& column, uint8_t chr, size_t copy_size)
         if(column.buffer_position != 0)
             flush_buffer(column);
         
-        if(copy_size >= column.buffer_size)
-        {
-            /// If the copy size is bigger than the buffer size we only need to memset once
-            /// Fill the buffer once and write it multiple times
-            memset(column.buffer, chr, column.buffer_size);
-            
-            while(copy_size >= column.buffer_size)
-            {
-                flush_buffer(column);
-                copy_size -= column.buffer_size;
-            }
-            
-            column.buffer_position = copy_size;
-        }
-        else
+        while(copy_size >= column.buffer_size)
         {
-            /// Just fill the buffer
-            memset(column.buffer, chr, copy_size);
-            column.buffer_position = copy_size;
+            /// Write out whole buffers of the character, flushing may swap in a different buffer so fill it each time
+            size_t flushed_size = column.buffer_size;
+            memset(column.buffer, chr, flushed_size);
+            column.buffer_position = flushed_size;
+            flush_buffer(column);
+            copy_size -= flushed_size;
         }
+        
+        /// Just fill the buffer with the rest
+        memset(column.buffer, chr, copy_size);
+        column.buffer_position = copy_size;
     }
 }
 
-/// Allows us to write the code like a state machine and can stopped and resumed on buffer boundaries
-enum CSVState
-{
-    OnRowInitial, /// This means that we are on a newline
-    OnColumnInitial, /// This means that we are on a comma
-    InSimpleColumn, /// This means that we write to the same column until we hit a comma
-    InQuotedStringColumn, /// This means that we are in a quoted string and we ended on a non-quote
-    InQuotedStringColumnOnQuote /// This means we are in a quoted string and we ended on a quote
-};
-    
 /**
- * This is the main loop of the function.
- * Read a chunk from the input file.
- *   Copy each item to the respective output buffer
- *     If the output buffer fills up
- *       Write to the respective output file
- *       Copy the remainder of the of the output column
- */
-void split_csv(int input_fd, std::string name)
-{
-    bool input_buffer_on_heap = should_use_heap(BUFFER_SIZE + 10);
-    /// Allocate more space for the input buffer for sentinel characters
-    uint8_t* input_buffer; 
-    ALLOCATE_BUFFER(input_buffer_on_heap, input_buffer, BUFFER_SIZE + 10);
-    input_buffer[BUFFER_SIZE] = '\n';
-    input_buffer[BUFFER_SIZE + 1] = ',';
-    input_buffer[BUFFER_SIZE + 2] = '"';
-    uint8_t* NEWLINE_SENTINEL = input_buffer + BUFFER_SIZE;
-    uint8_t* COMMA_SENTINEL = input_buffer + BUFFER_SIZE + 1;
-    uint8_t* DQUOTE_SENTINEL = input_buffer + BUFFER_SIZE + 2;
-    uint8_t* next_newline;
-    std::vector<ColumnInfo> column_infos;
-    size_t current_row = 0;
-    size_t current_column = 0;
-    CSVState current_state = OnColumnInitial;
-    
-    while(true)
+ * Adds a complete field and its terminating newline to a column.
+ * Most fields are short and fit in the remaining buffer, so that case is kept small enough to inline. Skipped columns
+ * and Arrow columns have no buffer, so they always take the slow path and cost nothing more on the fast path.
+ */
+inline void add_field_to_column(ColumnInfo& column, const uint8_t* from_buffer, size_t copy_size)
+{
+    if(__builtin_expect(column.buffer_position + copy_size < column.buffer_size && column.unquoter == nullptr, 1))
     {
-        read_chunk:;
-        auto bytes_total = read(input_fd, input_buffer, BUFFER_SIZE); /// Bytes total represent's the input chunk size
-        if(__builtin_expect(bytes_total == -1, 0))
-        {
-            /// Error with read
-            perror("Error reading file");
-            exit(1);
-        }
-        else if(__builtin_expect(bytes_total == 0, 0))
-        {
-            /// No more data - make sure every column has been output
+        memcpy(column.buffer + column.buffer_position, from_buffer, copy_size);
+        column.buffer[column.buffer_position + copy_size] = '\n';
+        column.buffer_position += copy_size + 1;
+    }
+    else if(column.arrow != nullptr && column.unquoter == nullptr)
+    {
+        column.arrow->add_field(from_buffer, copy_size);
+        if(column.arrow->batch_full())
+            write_arrow_batch(column);
+    }
+    else
+    {
+        add_buffer_to_column(column, from_buffer, copy_size);
+        add_chars_to_column(column, '\n', 1);
+    }
+}
+
+/**
+ * What the column files are written as.
+ */
+enum OutputFormat
+{
+    CsvOutput, /// Each field on its own line, exactly as it was in the input
+    ArrowOutput, /// An Arrow IPC stream with a single utf8 column holding the fields as they were in the input
+    TypedOutput /// Numeric columns as packed binary arrays, other columns as CSV, with a sidecar giving their types
+};
+
+/**
+ * Which columns of the input are written out, by their position in the row from 0.
+ */
+class ColumnSelection
+{
+public:
+    std::vector<std::pair<size_t, size_t>> ranges; /// Inclusive ranges of selected columns, if empty every column is
+    std::vector<std::string> names; /// Columns selected by their header, these are turned into ranges once it is read
+    
+    bool includes(size_t column) const
+    {
+        if(ranges.empty())
+            return true;
+        for(auto& range : ranges)
+        {
+            if(range.first <= column && column <= range.second)
+                return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * The columns of one partition of the rows. While a row of the partition is being split they are swapped into the
+ * split state, and the copy here is left empty.
+ */
+class PartitionColumns
+{
+public:
+    std::string name; /// The prefix for the partition's files
+    std::vector<ColumnInfo> column_infos;
+    size_t current_row;
+    size_t rows_until_file;
+};
+
+/**
+ * Everything the state machine needs to carry from one chunk of input to the next.
+ */
+class SplitState
+{
+public:
+    std::string name; /// The prefix for the column files, or empty for in-memory columns
+    bool in_memory; /// If set the columns are collected in memory rather than written to files
+    WriteQueue* write_queue; /// If set, column files are written on a writer thread
+    UringWriter* uring_writer; /// If set, column files are written through io_uring
+    BoundedMemory* bounded_memory; /// If set, column buffers and open files are kept within limits
+    BufferBudget* buffer_budget; /// If set, column buffers are resized to suit their output
+    BufferArena arena; /// Where the column and I/O buffers come from
+    OutputFormat format; /// What the column files are written as
+    bool statistics; /// Whether the columns are profiled as they are written
+    bool unquote; /// Whether the columns get the values of the fields rather than the fields as they are in the input
+    uint8_t quote; /// The quote of the input's dialect, which the column output keeps unless it is unquoted
+    OutputCompression compression; /// How the column files are compressed
+    ColumnSelection selection; /// The columns that are written out
+    std::vector<std::string> column_names; /// File names for the columns taken from the header, if there was one
+    std::vector<ColumnInfo> column_infos;
+    size_t current_row;
+    TokenizerState tokenizer; /// Where the tokenizer is up to in the input, and the rows it is to pass over
+    size_t index_interval; /// If not 0, the start of every index_interval'th row is kept in row_offsets
+    size_t rows_until_index; /// Rows to go until the next row start that is indexed
+    std::vector<uint64_t> row_offsets; /// Where the indexed rows start in the input
+    RowSampler row_sampler; /// Picks the rows that are written
+    size_t rows_until_skip; /// Rows to write before asking the row sampler for the next run, as of the last row check
+    size_t rows_per_file; /// If not 0, each column is written to a series of files of this many rows
+    size_t rows_until_file; /// Rows to go until the columns move on to their next files, as of the last row check
+    size_t rows_until_check; /// Rows to write until the row sampler or the column files need looking at
+    size_t rows_checked; /// Where rows_until_check counted down from
+    RowPartitioning partitioning; /// How the rows are shared out between partitions
+    std::vector<PartitionColumns> partitions; /// If not empty, each row is written to the columns of its partition
+    size_t partition; /// The partition whose columns are in column_infos
+    const uint8_t* input_end; /// The end of the mapped input, which a row is read ahead to for its key
+    
+    SplitState(std::string name, bool in_memory = false) : name(name), in_memory(in_memory), write_queue(nullptr), uring_writer(nullptr), bounded_memory(nullptr), buffer_budget(nullptr), format(CsvOutput), statistics(false), unquote(false), quote('"'), current_row(0), index_interval(0), rows_until_index(SIZE_MAX), rows_until_skip(SIZE_MAX), rows_per_file(0), rows_until_file(SIZE_MAX), rows_until_check(SIZE_MAX), rows_checked(SIZE_MAX), partition(0), input_end(nullptr)
+    {
+    }
+    
+    /**
+     * Only writes the rows that selection picks. This has to come before index_rows.
+     */
+    void select_rows(const RowSelection& selection)
+    {
+        row_sampler = RowSampler(selection);
+        tokenizer.stopped = !row_sampler.next_run(tokenizer.rows_to_pass_over, rows_until_skip);
+        count_down_rows();
+    }
+    
+    /**
+     * Writes each column to a series of files, moving on to the next file every rows rows.
+     */
+    void shard_rows(size_t rows)
+    {
+        rows_per_file = rows;
+        rows_until_file = rows;
+        count_down_rows();
+    }
+    
+    /**
+     * Shares the rows out between the partitions of partitioning, each with its own set of column files named
+     * <prefix>p0003_XXX.csv and so on. The rows are read ahead to input_end for their keys. Every row is then checked,
+     * as each may go to a different partition.
+     */
+    void partition_rows(const RowPartitioning& partitioning, const uint8_t* input_end)
+    {
+        this->partitioning = partitioning;
+        this->input_end = input_end;
+        partitions.resize(partitioning.partition_count);
+        for(size_t i = 0; i < partitions.size(); i++)
+        {
+            char partition_buffer[32];
+            snprintf(partition_buffer, sizeof(partition_buffer), "p%04zu_", i);
+            partitions[i].name = name + partition_buffer;
+            partitions[i].current_row = 0;
+            partitions[i].rows_until_file = rows_until_file;
+        }
+        partition = 0;
+        count_down_rows();
+    }
+    
+    /**
+     * Swaps the columns of the next partition in for the current one's.
+     */
+    void enter_partition(size_t next)
+    {
+        if(next == partition)
+            return;
+        swap_partition_columns();
+        partition = next;
+        swap_partition_columns();
+    }
+    
+    /**
+     * The prefix for the files of the current partition's columns.
+     */
+    const std::string& file_prefix() const
+    {
+        return partitions.empty() ? name : partitions[partition].name;
+    }
+    
+    /**
+     * The number of rows written to the columns of every partition.
+     */
+    size_t rows_written() const
+    {
+        size_t rows = current_row;
+        for(size_t i = 0; i < partitions.size(); i++)
+            rows += i != partition ? partitions[i].current_row : 0;
+        return rows;
+    }
+    
+    /**
+     * Counts down to whichever of the end of the row sampler's run and the end of the column files comes first, so
+     * the state machine only has the one count to keep per row.
+     */
+    void count_down_rows()
+    {
+        rows_checked = rows_until_check = partitions.empty() ? std::min(rows_until_skip, rows_until_file) : 1;
+    }
+    
+    /**
+     * Starts indexing every interval'th row, from the row that the tokenizer is at. If rows are passed over first,
+     * the row after them is row 0.
+     */
+    void index_rows(size_t interval)
+    {
+        index_interval = interval;
+        if(tokenizer.rows_to_pass_over == 0)
+        {
+            rows_until_index = interval;
+            row_offsets.push_back(tokenizer.input_offset);
+        }
+        else
+        {
+            rows_until_index = 1; /// Indexed once the rows before it have been passed over
+        }
+    }
+    
+private:
+    void swap_partition_columns()
+    {
+        std::swap(column_infos, partitions[partition].column_infos);
+        std::swap(current_row, partitions[partition].current_row);
+        std::swap(rows_until_file, partitions[partition].rows_until_file);
+    }
+};
+
+/**
+ * Creates the file for the column's current shard. An Arrow stream starts with its schema, whose field is named like
+ * the column rather than the file.
+ */
+void open_column_file(SplitState& state, ColumnInfo& column)
+{
+    std::string extension = std::string(column.arrow != nullptr ? ".arrow" : ".csv") + state.compression.extension();
+    column.output_fd = open(column_file_name(state.file_prefix(), state.column_names, column, state.rows_per_file != 0, extension.c_str()).c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if(column.output_fd == -1)
+    {
+        perror("Error opening file for writing");
+        exit(1);
+    }
+    column.file_offset = 0;
+    if(column.arrow != nullptr)
+    {
+        std::vector<uint8_t> schema = arrow_schema_message(column_file_name("", state.column_names, column.column_index, ""));
+        write_all(column.output_fd, schema.data(), schema.size());
+    }
+}
+
+/**
+ * Ends the current file of every column from first_column on and starts the next one, when the rows are split between
+ * files. Everything the columns hold is flushed to the files they are leaving.
+ */
+void start_next_files(SplitState& state, size_t first_column = 0)
+{
+    std::vector<ColumnInfo>& column_infos = state.column_infos;
+    for(size_t i = first_column; i < column_infos.size(); i++)
+    {
+        if(column_infos[i].bounded_memory == nullptr)
+            flush_buffer(column_infos[i]);
+    }
+#ifdef HAVE_LIBURING
+    /// Writes through io_uring carry their file, so the files can only be closed once they are done
+    if(state.uring_writer != nullptr)
+        state.uring_writer->finish();
+#endif
+    
+    for(size_t i = first_column; i < column_infos.size(); i++)
+    {
+        ColumnInfo& column = column_infos[i];
+        if(column.skipped)
+        {
+            continue;
+        }
+        else if(column.bounded_memory != nullptr)
+        {
+            column.bounded_memory->next_file(column);
+            continue;
+        }
+        
+        close_column_file(column);
+        column.shard++;
+        open_column_file(state, column);
+    }
+}
+
+/**
+ * Swaps in the columns of the partition that the row starting at row_start goes to.
+ */
+template<typename Dialect>
+void route_row(SplitState& state, const uint8_t* row_start)
+{
+    const RowPartitioning& partitioning = state.partitioning;
+    state.enter_partition(partition_of_row<Dialect>(row_start, state.input_end, partitioning.key_column, partitioning.partition_count));
+}
+
+/**
+ * Called when rows_until_check runs out, at the end of a run of rows from the row sampler, when the column files
+ * have all of their rows, or after every row that is partitioned. The sampler gives its next run, the columns move on
+ * to their next files, or the next row's partition is swapped in if it isn't to be passed over.
+ * Returns false once every row that is wanted has been written.
+ */
+template<typename Dialect>
+bool check_rows(SplitState& state, const uint8_t* row_start)
+{
+    state.rows_until_skip -= state.rows_checked;
+    state.rows_until_file -= state.rows_checked;
+    if(state.rows_until_skip == 0 && !state.row_sampler.next_run(state.tokenizer.rows_to_pass_over, state.rows_until_skip))
+        return false;
+    if(state.rows_until_file == 0)
+    {
+        start_next_files(state);
+        state.rows_until_file = state.rows_per_file;
+    }
+    if(!state.partitions.empty() && state.tokenizer.rows_to_pass_over == 0)
+        route_row<Dialect>(state, row_start);
+    state.count_down_rows();
+    return true;
+}
+
+/**
+ * Create column info for a fresh column, with a blank line for each of the rows before it.
+ * If the rows are split between files, the column's earlier files are written out with blank lines as well.
+ */
+void add_column(SplitState& state, size_t current_row)
+{
+    state.column_infos.resize(state.column_infos.size() + 1);
+    ColumnInfo& info = state.column_infos.back();
+    info.column_index = state.column_infos.size() - 1;
+    info.shard = 0;
+    info.write_queue = state.write_queue;
+    info.uring_writer = state.uring_writer;
+    info.bounded_memory = state.bounded_memory;
+    info.buffer_budget = state.buffer_budget;
+    info.target_size = BUFFER_SIZE;
+    info.epoch_output = 0;
+    info.file_offset = 0;
+    info.buffer_position = 0;
+    info.output_fd = -1;
+    info.skipped = !state.selection.includes(info.column_index);
+    if(info.skipped)
+    {
+        /// Nothing is allocated or opened for a column that isn't selected
+        info.buffer = nullptr;
+        info.buffer_size = 0;
+    }
+    else if(state.bounded_memory != nullptr)
+    {
+        /// The buffer comes from the slab, which may spill other columns to make room
+        info.buffer = nullptr;
+        info.buffer_size = 0;
+        state.bounded_memory->create_file(info);
+        state.bounded_memory->flush(info);
+    }
+    else
+    {
+        if(state.format == ArrowOutput)
+        {
+            info.arrow.reset(new ArrowColumn());
+            info.buffer = nullptr;
+            info.buffer_size = 0;
+        }
+        else
+        {
+            info.buffer_size = BUFFER_SIZE;
+            info.buffer = state.arena.allocate(BUFFER_SIZE);
+        }
+        if(!state.in_memory)
+            open_column_file(state, info);
+    }
+    if(state.unquote && !info.skipped)
+        info.unquoter.reset(new FieldUnquoter(state.format != ArrowOutput, state.quote));
+    int output_quote = state.unquote ? FieldBoundaries::NO_QUOTE : state.quote;
+    if(state.format == TypedOutput && !info.skipped && !state.in_memory)
+        info.type_inference.reset(new TypeInference(output_quote));
+    if(state.statistics && !info.skipped && !state.in_memory)
+        info.statistics.reset(new ColumnStatistics(output_quote));
+    if(state.compression.method != NoCompression && !info.skipped && !state.in_memory)
+        info.compressor.reset(new ColumnCompressor(state.compression));
+    if(state.rows_per_file != 0 && !info.skipped)
+    {
+        for(size_t shard = current_row/state.rows_per_file; info.shard != shard;)
+        {
+            add_chars_to_column(info, '\n', state.rows_per_file);
+            start_next_files(state, info.column_index);
+        }
+        current_row %= state.rows_per_file;
+    }
+    add_chars_to_column(info, '\n', current_row);
+}
+
+/**
+ * Maps the whole of a regular file into memory for reading.
+ * Returns nullptr if the file cannot be mapped, in which case the caller should fall back to read().
+ */
+const uint8_t* map_input(int input_fd, size_t& mapped_size)
+{
+    struct stat stat_info;
+    if(fstat(input_fd, &stat_info) == -1 || !S_ISREG(stat_info.st_mode) || stat_info.st_size == 0)
+        return nullptr;
+    
+    mapped_size = stat_info.st_size;
+    void* mapping = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    if(mapping == MAP_FAILED)
+        return nullptr;
+    
+    /// We only ever walk forward over the mapping, if there is an error, well we tried our best.
+    madvise(mapping, mapped_size, MADV_SEQUENTIAL);
+    return static_cast<const uint8_t*>(mapping);
+}
+
+/**
+ * Maps the input like map_input, unless it is compressed. A compressed file can only be decompressed from its start,
+ * so it is read and decompressed a chunk at a time instead, and this returns nullptr with mapped_size still set.
+ */
+const uint8_t* map_uncompressed_input(int input_fd, size_t& mapped_size)
+{
+    const uint8_t* mapped_input = map_input(input_fd, mapped_size);
+    if(mapped_input != nullptr && input_compression(mapped_input, mapped_size) != PlainInput)
+    {
+        munmap(const_cast<uint8_t*>(mapped_input), mapped_size);
+        return nullptr;
+    }
+    return mapped_input;
+}
+
+/**
+ * What to do with the first record of the input.
+ */
+enum HeaderMode
+{
+    NoHeader, /// The first record is data
+    SkipHeader, /// The first record names the columns and is left out of the column files
+    KeepHeader /// The first record names the columns and is written to the column files as well
+};
+
+/**
+ * Reads the fields of the first record in [begin, end), with the quoting taken off. The record may end with LF or CRLF.
+ * Returns just past the newline that ends the record. If the record doesn't end before end this returns nullptr, 
+ * unless end is the end of the input, in which case it returns end.
+ */
+template<typename Dialect>
+const uint8_t* parse_header(const uint8_t* begin, const uint8_t* end, bool at_end_of_input, std::vector<std::string>& fields)
+{
+    fields.assign(1, std::string());
+    bool in_quotes = false;
+    bool at_field_start = true;
+    for(const uint8_t* ptr = begin; ptr != end; ptr++)
+    {
+        if(in_quotes)
+        {
+            if(*ptr != Dialect::quote)
+                fields.back() += *ptr;
+            else if(ptr + 1 == end && !at_end_of_input)
+                return nullptr; /// We can't tell yet whether the quote is escaped
+            else if(ptr + 1 != end && *(ptr + 1) == Dialect::quote)
+                fields.back() += *ptr++; /// An escaped quote
+            else
+                in_quotes = false;
+            continue;
+        }
+        
+        if(*ptr == Dialect::quote && at_field_start)
+            in_quotes = true;
+        else if(*ptr == Dialect::delimiter)
+            fields.emplace_back();
+        else if(*ptr == '\n')
+        {
+            /// The \r of a CRLF isn't part of the last field, outside of quotes it can only have been added to it
+            if(ptr != begin && *(ptr - 1) == '\r')
+                fields.back().pop_back();
+            return ptr + 1;
+        }
+        else
+            fields.back() += *ptr; /// Like the state machine, anything after a closing quote carries on the field
+        at_field_start = *ptr == Dialect::delimiter;
+    }
+    if(at_end_of_input && !in_quotes && end != begin && *(end - 1) == '\r')
+        fields.back().pop_back(); /// Like the state machine, a \r left at the end of the input is dropped
+    return at_end_of_input ? end : nullptr;
+}
+
+/**
+ * Reads from the input until it holds the whole of the first record, and parses it into fields.
+ * Returns everything that was read, which may run on past the header, and sets header_size to the header's length.
+ */
+template<typename Dialect>
+std::vector<uint8_t> read_header(InputReader& input_reader, std::vector<std::string>& fields, size_t& header_size)
+{
+    std::vector<uint8_t> input;
+    while(true)
+    {
+        /// Read more each time so that a very long header isn't parsed over and over
+        size_t read_size = std::max(BUFFER_SIZE, input.size());
+        size_t old_size = input.size();
+        input.resize(old_size + read_size);
+        ssize_t bytes_total = input_reader.read(input.data() + old_size, read_size);
+        if(bytes_total == -1)
+        {
+            perror("Error reading file");
+            exit(1);
+        }
+        input.resize(old_size + bytes_total);
+        
+        const uint8_t* header_end = parse_header<Dialect>(input.data(), input.data() + input.size(), bytes_total == 0, fields);
+        if(header_end != nullptr)
+        {
+            header_size = header_end - input.data();
+            return input;
+        }
+    }
+}
+
+/**
+ * Names the columns of a split after the fields of the header, and turns any names in the selection or the partition
+ * key into numbers.
+ * The names are made safe for file names, anything other than letters, digits, '-', '_' and '.' becomes '_'. An empty
+ * field keeps the column's number, a name too long for a file name is cut short, and a name that has already been
+ * handed out gets the first of _2, _3, ... that makes it unique. A name in the selection picks every column with that
+ * header, and a partition key name picks the first.
+ */
+void apply_header(SplitState& state, const std::vector<std::string>& header)
+{
+    /// Leave room in the file name for the prefix, a _N suffix and the column file's own suffixes
+    size_t prefix_length = state.name.size() - (state.name.find_last_of('/') + 1);
+    size_t max_name_length = prefix_length + COLUMN_NAME_RESERVE < NAME_MAX ? NAME_MAX - prefix_length - COLUMN_NAME_RESERVE : 1;
+    std::map<std::string, size_t> next_suffixes;
+    std::set<std::string> used_names;
+    state.column_names.clear();
+    for(size_t i = 0; i < header.size(); i++)
+    {
+        /// Leave out surrounding whitespace, including a carriage return at the end of the line
+        size_t first = header[i].find_first_not_of(" \t\r");
+        size_t last = header[i].find_last_not_of(" \t\r");
+        std::string column_name = first == std::string::npos ? std::string() : header[i].substr(first, last - first + 1);
+        for(char& c : column_name)
+        {
+            if(!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.')
+                c = '_';
+        }
+        if(column_name.empty())
+        {
+            char id_buffer[24];
+            sprintf(id_buffer, "%03zu", i + 1);
+            column_name = id_buffer;
+        }
+        else if(column_name[0] == '.')
+        {
+            column_name[0] = '_'; /// No hidden files, or . and ..
+        }
+        if(column_name.size() > max_name_length)
+            column_name.resize(max_name_length);
+        
+        /// A suffixed name can match another header, such as the second a in a,a,a_2, so every name is checked
+        if(used_names.count(column_name) != 0)
+        {
+            size_t& suffix = next_suffixes[column_name];
+            std::string suffixed_name;
+            do
+            {
+                suffix = suffix == 0 ? 2 : suffix + 1;
+                suffixed_name = column_name + "_" + std::to_string(suffix);
+            } while(used_names.count(suffixed_name) != 0);
+            column_name = suffixed_name;
+        }
+        used_names.insert(column_name);
+        state.column_names.push_back(column_name);
+    }
+    
+    for(auto& selected_name : state.selection.names)
+    {
+        size_t range_count = state.selection.ranges.size();
+        for(size_t column = 0; column < header.size(); column++)
+        {
+            if(header[column] == selected_name)
+                state.selection.ranges.emplace_back(column, column);
+        }
+        if(state.selection.ranges.size() == range_count)
+        {
+            fprintf(stderr, "Column %s is not in the header\n", selected_name.c_str());
+            exit(1);
+        }
+    }
+    state.selection.names.clear();
+    
+    if(!state.partitioning.key_name.empty())
+    {
+        auto found = std::find(header.begin(), header.end(), state.partitioning.key_name);
+        if(found == header.end())
+        {
+            fprintf(stderr, "Column %s is not in the header\n", state.partitioning.key_name.c_str());
+            exit(1);
+        }
+        state.partitioning.key_column = found - header.begin();
+        state.partitioning.key_name.clear();
+    }
+}
+    
+/**
+ * The sink that the tokenizer gives the fields of the split to, which adds each field to its column.
+ * Once a row ends the columns it had no field for get a blank line, and the row counts for the row sampler, the
+ * column files and the row index are kept. The row and index counts are kept here for the chunk, and save puts them
+ * back in the state.
+ */
+template<typename Dialect>
+class ColumnSink
+{
+public:
+    SplitState& state;
+    std::vector<ColumnInfo>& column_infos;
+    size_t current_row;
+    size_t rows_until_index;
+    
+    explicit ColumnSink(SplitState& state) : state(state), column_infos(state.column_infos), current_row(state.current_row), rows_until_index(state.rows_until_index)
+    {
+    }
+    
+    void save()
+    {
+        state.current_row = current_row;
+        state.rows_until_index = rows_until_index;
+    }
+    
+    void on_field(size_t column, const uint8_t* ptr, size_t length, bool)
+    {
+        if(__builtin_expect(column == column_infos.size(), 0))
+            add_column(state, current_row);
+        add_field_to_column(column_infos[column], ptr, length);
+    }
+    
+    void on_row_end()
+    {
+        TokenizerState& tokenizer = state.tokenizer;
+        size_t current_column = tokenizer.current_column;
+        if(__builtin_expect(current_column == 0, 0))
+        {
+            /// The rows that the row sampler left out have been passed over, the next row may go to another partition
+            if(!state.partitions.empty())
+            {
+                state.current_row = current_row;
+                route_row<Dialect>(state, tokenizer.next_row);
+                current_row = state.current_row;
+            }
+        }
+        else
+        {
+            /// We need to update the unread columns with newlines
+            while(current_column != column_infos.size())
+                add_chars_to_column(column_infos[current_column++], '\n', 1);
+            current_row++;
             
-            /// Flush buffers and free them up
-            for(auto& c : column_infos)
+            if(__builtin_expect(--state.rows_until_check == 0, 0))
+            {
+                /// The run of rows to write is over, the column files are full or the next row may go to another
+                /// partition's columns, the sampler may want rows passed over
+                state.current_row = current_row;
+                if(!check_rows<Dialect>(state, tokenizer.next_row))
+                {
+                    /// Every row that is wanted has been written, the rest of the input is left alone
+                    tokenizer.stopped = true;
+                    return;
+                }
+                current_row = state.current_row;
+                if(tokenizer.rows_to_pass_over != 0)
+                    return; /// Indexed once they have been passed over
+            }
+        }
+        
+        if(__builtin_expect(--rows_until_index == 0, 0))
+        {
+            /// A row start for the row index, this is outside of any quotes so it is a real row
+            state.row_offsets.push_back(tokenizer.next_row_offset());
+            rows_until_index = state.index_interval;
+        }
+    }
+};
+
+/**
+ * Splits a chunk of input of any size into the columns, carrying on from where the last chunk stopped. The tokenizer
+ * walks it TOKENIZER_CHUNK_SIZE bytes at a time and stops early once every row wanted has been written. The input is
+ * never written to, so a chunk may point directly into a read-only mapping, such as the whole of a mapped file.
+ * Every Dialect gets its own instantiation of the tokenizer, with its delimiter and quote compiled in and the column
+ * sink inlined into it.
+ */
+template<typename Dialect>
+void split_chunk(SplitState& state, const uint8_t* chunk_begin, size_t bytes_total)
+{
+    ColumnSink<Dialect> sink(state);
+    CsvTokenizer<Dialect, ColumnSink<Dialect>> tokenizer(sink, state.tokenizer);
+    tokenizer.feed(chunk_begin, bytes_total);
+    sink.save();
+}
+
+/**
+ * Deletes the files that the columns moved on to when the rows split between files ran out just after the last row.
+ */
+void remove_empty_files(SplitState& state)
+{
+    std::string extension = std::string(state.format == ArrowOutput ? ".arrow" : ".csv") + state.compression.extension();
+    for(auto& c : state.column_infos)
+    {
+        if(!c.skipped && c.shard != 0 && c.shard*state.rows_per_file == state.current_row)
+            unlink(column_file_name(state.file_prefix(), state.column_names, c, true, extension.c_str()).c_str());
+    }
+}
+
+/**
+ * Finishes off a final row that had no trailing newline.
+ */
+void finish_last_row(SplitState& state)
+{
+    std::vector<ColumnInfo>& column_infos = state.column_infos;
+    TokenizerState& tokenizer = state.tokenizer;
+    if(tokenizer.current_state != OnRowInitial && tokenizer.rows_to_pass_over == 0)
+    {
+        /// The tokenizer still has what there is of the last field
+        std::vector<uint8_t>& field = tokenizer.field;
+        if(tokenizer.current_state == InSimpleColumn && !field.empty() && field.back() == '\r')
+            field.pop_back(); /// A \r at the very end of the input is dropped like the \r of a CRLF
+        size_t current_column = tokenizer.current_column;
+        if(current_column == column_infos.size())
+            add_column(state, state.current_row);
+        add_field_to_column(column_infos[current_column++], field.data(), field.size());
+        
+        /// Make sure every column has been output for the last row
+        while(current_column != column_infos.size())
+            add_chars_to_column(column_infos[current_column++], '\n', 1);
+        
+        state.current_row++;
+    }
+    tokenizer.field.clear();
+    tokenizer.current_column = 0;
+    tokenizer.current_state = OnRowInitial;
+}
+
+/**
+ * Finishes off a final row that had no trailing newline, and flushes and frees all of the columns.
+ * If other partitions still have columns to finish, the writer is left running and the files are closed behind the
+ * writes queued for them.
+ */
+void finish_split(SplitState& state, bool finish_writer = true)
+{
+    std::vector<ColumnInfo>& column_infos = state.column_infos;
+    finish_last_row(state);
+    
+    if(state.bounded_memory != nullptr)
+    {
+        /// The buffers belong to the slab
+        state.bounded_memory->finish();
+        if(state.rows_per_file != 0)
+            remove_empty_files(state);
+        return;
+    }
+    
+    /// Flush buffers and free them up, the files can only be closed once the writer is done with them
+    for(auto& c : column_infos)
+        flush_buffer(c);
+    if(state.write_queue != nullptr && finish_writer)
+        state.write_queue->finish();
+#ifdef HAVE_LIBURING
+    if(state.uring_writer != nullptr)
+        state.uring_writer->finish();
+#endif
+    for(auto& c : column_infos)
+    {
+        state.arena.release(c.buffer, c.buffer_size);
+        c.buffer = nullptr;
+        if(c.output_fd != -1)
+            close_column_file(c, !finish_writer);
+        c.arrow.reset();
+    }
+    if(state.rows_per_file != 0)
+        remove_empty_files(state);
+}
+
+/**
+ * Quotes a string for JSON.
+ */
+std::string json_string(const std::string& text)
+{
+    std::string quoted = "\"";
+    for(char c : text)
+    {
+        if(c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if(static_cast<unsigned char>(c) < 0x20)
+        {
+            char escape[8];
+            sprintf(escape, "\\u%04x", c);
+            quoted += escape;
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Packs values into the low bytes of each, which are the ones that matter on the little-endian machines we build for.
+ */
+template<typename Narrow>
+void pack_values(const std::vector<int64_t>& values, std::vector<uint8_t>& output)
+{
+    output.resize(values.size()*sizeof(Narrow));
+    uint8_t* packed = output.data();
+    for(int64_t value : values)
+    {
+        Narrow narrow = Narrow(value);
+        memcpy(packed, &narrow, sizeof(narrow));
+        packed += sizeof(narrow);
+    }
+}
+
+/**
+ * Rewrites a column file that was found to hold only integers or only decimal numbers as a packed little-endian array
+ * with a value for each row, null rows are 0. Integers are stored in the narrowest of int8, int16, int32 and int64 that
+ * holds all of them. Returns the name of the type the values were stored as.
+ * The type is only known once the last field has been seen, so the text is written first and converted while it is
+ * still in the page cache.
+ */
+const char* convert_column_file(const std::string& text_file_name, const std::string& binary_file_name, ColumnType type, uint64_t row_count)
+{
+    int text_fd = open(text_file_name.c_str(), O_RDONLY);
+    int binary_fd = open(binary_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if(text_fd == -1 || binary_fd == -1)
+    {
+        perror("Error opening file for conversion");
+        exit(1);
+    }
+    
+    /// Every field of the column ends with a newline, and none of them are quoted
+    size_t text_size = 0;
+    const uint8_t* text = map_input(text_fd, text_size);
+    const uint8_t* text_end = text + text_size;
+    std::vector<uint8_t> output;
+    const char* storage_type;
+    if(type == Int64Column)
+    {
+        std::vector<int64_t> values;
+        values.reserve(row_count);
+        int64_t min_value = 0;
+        int64_t max_value = 0;
+        for(const uint8_t* ptr = text; ptr != text_end; ptr++)
+        {
+            int64_t value;
+            size_t size;
+            if(text_end - ptr >= 8 && parse_short_digits(ptr, value, size))
             {
-                flush_buffer(c);
-                if(c.on_heap)
-                    free(c.buffer);
+                /// Most fields are a few digits, which are parsed all at once
+                ptr += size;
+            }
+            else
+            {
+                /// The fields were checked to fit, so there is no need to look out for overflow
+                bool negative = *ptr == '-';
+                if(*ptr == '-' || *ptr == '+')
+                    ptr++;
+                int64_t total = 0;
+                for(; *ptr != '\n'; ptr++)
+                    total = total*10 - (*ptr - '0');
+                value = negative ? total : -total;
+            }
+            min_value = std::min(min_value, value);
+            max_value = std::max(max_value, value);
+            values.push_back(value);
+        }
+        
+        if(min_value >= INT8_MIN && max_value <= INT8_MAX)
+        {
+            pack_values<int8_t>(values, output);
+            storage_type = "int8";
+        }
+        else if(min_value >= INT16_MIN && max_value <= INT16_MAX)
+        {
+            pack_values<int16_t>(values, output);
+            storage_type = "int16";
+        }
+        else if(min_value >= INT32_MIN && max_value <= INT32_MAX)
+        {
+            pack_values<int32_t>(values, output);
+            storage_type = "int32";
+        }
+        else
+        {
+            pack_values<int64_t>(values, output);
+            storage_type = "int64";
+        }
+    }
+    else
+    {
+        output.resize(row_count*sizeof(double));
+        uint8_t* packed = output.data();
+        for(const uint8_t* line = text; line != text_end && packed != output.data() + output.size();)
+        {
+            const uint8_t* newline = static_cast<const uint8_t*>(memchr(line, '\n', text_end - line));
+            double value = newline == line ? 0.0 : parse_double(line, newline - line);
+            memcpy(packed, &value, sizeof(value));
+            packed += sizeof(value);
+            line = newline + 1;
+        }
+        storage_type = "double";
+    }
+    write_all(binary_fd, output.data(), output.size());
+    
+    if(text != nullptr)
+        munmap(const_cast<uint8_t*>(text), text_size);
+    close(text_fd);
+    close(binary_fd);
+    unlink(text_file_name.c_str());
+    return storage_type;
+}
+
+/**
+ * Writes out one of the JSON files that describe the split.
+ */
+void write_json_file(const std::string& file_name, const std::string& json)
+{
+    int json_fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if(json_fd == -1)
+    {
+        perror("Error opening file for writing");
+        exit(1);
+    }
+    write_all(json_fd, reinterpret_cast<const uint8_t*>(json.data()), json.size());
+    close(json_fd);
+}
+
+/**
+ * Finishes a typed split. Integer and decimal columns are converted to binary <prefix>XXX.bin files, and 
+ * <prefix>types.json records each column's type, file and the ranges of rows whose field was empty. The type of a
+ * binary column is the type it was stored as.
+ */
+void finish_typed_columns(SplitState& state)
+{
+    std::string json = "{\"columns\": [";
+    bool first_column = true;
+    for(auto& column : state.column_infos)
+    {
+        if(column.type_inference == nullptr)
+            continue;
+        
+        TypeInference& inference = *column.type_inference;
+        inference.finish();
+        ColumnType type = inference.type();
+        const char* type_name = column_type_name(type);
+        std::string file_name = column_file_name(state.file_prefix(), state.column_names, column.column_index);
+        if(type == Int64Column || type == DoubleColumn)
+        {
+            std::string binary_file_name = column_file_name(state.file_prefix(), state.column_names, column.column_index, ".bin");
+            type_name = convert_column_file(file_name, binary_file_name, type, inference.row_count);
+            file_name = binary_file_name;
+        }
+        
+        json += first_column ? "\n" : ",\n";
+        first_column = false;
+        json += "  {\"column\": " + std::to_string(column.column_index);
+        json += ", \"name\": " + json_string(column_file_name("", state.column_names, column.column_index, ""));
+        json += ", \"type\": " + json_string(type_name);
+        json += ", \"file\": " + json_string(file_name);
+        json += ", \"rows\": " + std::to_string(inference.row_count);
+        json += ", \"nulls\": [";
+        for(size_t i = 0; i < inference.null_ranges.size(); i++)
+        {
+            json += i == 0 ? "[" : ", [";
+            json += std::to_string(inference.null_ranges[i].first) + ", " + std::to_string(inference.null_ranges[i].second) + "]";
+        }
+        json += "]}";
+        column.type_inference.reset();
+    }
+    json += "\n]}\n";
+    write_json_file(state.file_prefix() + "types.json", json);
+}
+
+/**
+ * Gives a double as a JSON number, with enough digits to read back the same value.
+ */
+std::string json_number(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.17g", value);
+    return text;
+}
+
+/**
+ * Finishes profiling the columns and writes <prefix>stats.json. The numeric figures are only for the fields that parse
+ * as numbers, and are null when none of them do. Lengths and the distinct estimate count the bytes of each field as it
+ * was written out.
+ */
+void finish_statistics(SplitState& state)
+{
+    std::string json = "{\"columns\": [";
+    bool first_column = true;
+    for(auto& column : state.column_infos)
+    {
+        if(column.statistics == nullptr)
+            continue;
+        
+        ColumnStatistics& statistics = *column.statistics;
+        statistics.finish();
+        bool numeric = statistics.numeric_count != 0;
+        json += first_column ? "\n" : ",\n";
+        first_column = false;
+        json += "  {\"column\": " + std::to_string(column.column_index);
+        json += ", \"name\": " + json_string(column_file_name("", state.column_names, column.column_index, ""));
+        json += ", \"count\": " + std::to_string(statistics.count);
+        json += ", \"empty\": " + std::to_string(statistics.empty_count);
+        json += ", \"min_length\": " + std::to_string(statistics.count == 0 ? 0 : statistics.min_length);
+        json += ", \"max_length\": " + std::to_string(statistics.max_length);
+        json += ", \"numeric\": " + std::to_string(statistics.numeric_count);
+        json += ", \"min\": " + (numeric ? json_number(statistics.numeric_min) : "null");
+        json += ", \"max\": " + (numeric ? json_number(statistics.numeric_max) : "null");
+        json += ", \"sum\": " + (numeric ? json_number(statistics.numeric_sum) : "null");
+        json += ", \"distinct\": " + std::to_string(uint64_t(statistics.distinct_estimate() + 0.5)) + "}";
+        column.statistics.reset();
+    }
+    json += "\n]}\n";
+    write_json_file(state.file_prefix() + "stats.json", json);
+}
+
+/**
+ * Writes <prefix>rows.idx, the row index. All of it is little-endian uint64s, a header of the bytes "CSVRIDX1", the
+ * interval, the number of rows and the number of input bytes consumed, up to the end of the last row split, followed by
+ * where every interval'th row starts in the input from row 0. A tool can seek straight to row r by starting at entry
+ * r/interval and skipping r%interval rows, and ranges of entries can be split in parallel with no need to know the
+ * quoting state before them.
+ */
+void write_row_index(SplitState& state)
+{
+    /// A newline at the end of the input makes it look like a row starts there
+    size_t interval = state.index_interval;
+    size_t row_count = state.rows_written();
+    state.row_offsets.resize((row_count + interval - 1)/interval);
+    
+    static const uint8_t magic[8] = {'C', 'S', 'V', 'R', 'I', 'D', 'X', '1'};
+    uint64_t header[4];
+    memcpy(&header[0], magic, sizeof(magic));
+    header[1] = interval;
+    header[2] = row_count;
+    header[3] = state.tokenizer.input_offset; /// Bytes consumed, which is the input size only if the whole input was split
+    int index_fd = open((state.name + "rows.idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if(index_fd == -1)
+    {
+        perror("Error opening file for writing");
+        exit(1);
+    }
+    write_all(index_fd, reinterpret_cast<const uint8_t*>(header), sizeof(header));
+    write_all(index_fd, reinterpret_cast<const uint8_t*>(state.row_offsets.data()), state.row_offsets.size()*sizeof(uint64_t));
+    close(index_fd);
+}
+
+/**
+ * A filled input buffer on its way from the reader thread to the parser.
+ */
+class InputChunk
+{
+public:
+    uint8_t* buffer;
+    ssize_t size; /// 0 at the end of the input
+};
+
+/**
+ * How a split should be done, the defaults do everything on one thread.
+ */
+class SplitOptions
+{
+public:
+    bool use_mmap = false; /// Map the input rather than reading it, only for regular files
+    size_t thread_count = 1; /// Threads that parse a mapped input
+    size_t queue_depth = 0; /// Input and output chunks queued between the I/O threads and the parser, 0 for no I/O threads
+    bool use_io_uring = false; /// Write the column files through io_uring
+    size_t max_memory = 0; /// If not 0, the column buffers share a slab of this many bytes and open files are pooled
+    ColumnSelection selection; /// The columns to write out, the files keep the numbers they would have without it
+    HeaderMode header = NoHeader; /// Whether the first record names the columns
+    OutputFormat format = CsvOutput; /// What the column files are written as, Arrow can't be used with max_memory
+    bool statistics = false; /// Write a profile of each column to <prefix>stats.json
+    size_t index_interval = 0; /// If not 0, write where every index_interval'th row starts to <prefix>rows.idx
+    bool unquote = false; /// Write the values of quoted fields, escaping backslashes and newlines outside of Arrow files
+    InputDialect dialect = CsvInput; /// The delimiter of the input
+    RowSelection rows; /// The rows that are written, anything other than every row splits on one thread
+    size_t rows_per_file = 0; /// If not 0, each column is written to a series of files of this many rows, on one thread
+    RowPartitioning partitioning; /// Shares the rows out between sets of column files by key, on one thread
+    OutputCompression compression; /// How the column files are compressed, only for csv output without max_memory
+    size_t writer_count = 1; /// Writer threads, which write and compress their share of the columns
+};
+
+/**
+ * Finishes the columns of a split, and their types and statistics. The partitions are finished in turn, each given
+ * blank columns for any it never had a field of, so every partition has the same set of files. The writer is only
+ * stopped after the last of them, and the types are only worked out once it has written everything.
+ */
+void finish_columns(SplitState& state, const SplitOptions& options)
+{
+    finish_last_row(state);
+    size_t partition_count = std::max<size_t>(1, state.partitions.size());
+    size_t column_count = state.column_infos.size();
+    for(auto& partition : state.partitions)
+        column_count = std::max(column_count, partition.column_infos.size());
+    
+    for(size_t i = 0; i < partition_count; i++)
+    {
+        if(!state.partitions.empty())
+            state.enter_partition(i);
+        while(state.column_infos.size() < column_count)
+            add_column(state, state.current_row);
+        finish_split(state, i + 1 == partition_count);
+    }
+    for(size_t i = 0; i < partition_count; i++)
+    {
+        if(!state.partitions.empty())
+            state.enter_partition(i);
+        if(options.format == TypedOutput)
+            finish_typed_columns(state);
+        if(options.statistics)
+            finish_statistics(state);
+    }
+}
+
+/**
+ * Get the input file a chunk at a time, either by reading it into an input buffer or by walking over a mapping of
+ * the file, and split each chunk. Compressed input is always read, and decompressed into the input buffers.
+ * If the queue depth isn't 0, read() and write() are called on their own threads, with up to that many chunks queued
+ * in each direction. The wall time is then closer to the slowest of input, parsing and output rather than their sum.
+ * The reader thread also does any decompression, so that overlaps with the parsing too.
+ * With io_uring the column files are written from the parsing thread instead, with up to that many writes in flight.
+ * This falls back to the writer thread if io_uring isn't available. In bounded memory mode files are always written
+ * from the parsing thread, as the open file pool may close a file at any time.
+ */
+template<typename Dialect>
+void split_input(int input_fd, std::string name, const SplitOptions& options)
+{
+    size_t queue_depth = options.queue_depth;
+    size_t mapped_size = 0;
+    const uint8_t* mapped_input = options.use_mmap ? map_uncompressed_input(input_fd, mapped_size) : nullptr;
+    if(options.partitioning.partition_count != 0 && mapped_input == nullptr && (mapped_size != 0 || !options.use_mmap))
+    {
+        fprintf(stderr, "--partition-by needs an uncompressed regular file as input, the rows are read ahead for their keys\n");
+        exit(1);
+    }
+    InputReader input_reader(input_fd); /// Only read from if the input isn't mapped
+    
+    SplitState state(name);
+    state.selection = options.selection;
+    state.partitioning = options.partitioning;
+    state.format = options.format;
+    state.statistics = options.statistics;
+    state.unquote = options.unquote;
+    state.compression = options.compression;
+    state.quote = Dialect::quote;
+    /// Arrow columns write their record batches from the parsing thread, and have no buffers to budget. Neither do
+    /// partitioned columns, as the budget can't follow them being swapped in and out
+    bool buffered_output = options.format == CsvOutput;
+    if(options.max_memory != 0)
+        state.bounded_memory = new BoundedMemory(state.column_infos, name, state.column_names, options.max_memory, options.rows_per_file != 0);
+#ifdef HAVE_LIBURING
+    if(options.use_io_uring && queue_depth != 0 && state.bounded_memory == nullptr && buffered_output)
+    {
+        state.uring_writer = new UringWriter(queue_depth, state.arena, BUFFER_SIZE);
+        if(!state.uring_writer->ready())
+        {
+            fprintf(stderr, "io_uring is not available, writing on a writer thread instead\n");
+            delete state.uring_writer;
+            state.uring_writer = nullptr;
+        }
+    }
+#else
+    if(options.use_io_uring)
+        fprintf(stderr, "Built without liburing, writing on a writer thread instead\n");
+#endif
+    if(queue_depth != 0 && state.uring_writer == nullptr && state.bounded_memory == nullptr && buffered_output)
+        state.write_queue = new WriteQueue(queue_depth, state.arena, options.writer_count);
+    if(state.bounded_memory == nullptr && buffered_output && options.partitioning.partition_count == 0)
+    {
+        const size_t* queued_size = state.write_queue != nullptr ? &state.write_queue->held_size : nullptr;
+#ifdef HAVE_LIBURING
+        if(state.uring_writer != nullptr)
+            queued_size = &state.uring_writer->queued_size();
+#endif
+        state.buffer_budget = new BufferBudget(state.column_infos, state.arena, COLUMN_BUFFER_BUDGET, queued_size);
+    }
+    
+    std::vector<uint8_t> header_input; /// Input that was read while looking for the end of the header
+    size_t header_size = 0;
+    if(options.header != NoHeader)
+    {
+        std::vector<std::string> header;
+        if(mapped_input != nullptr)
+            header_size = parse_header<Dialect>(mapped_input, mapped_input + mapped_size, true, header) - mapped_input;
+        else
+            header_input = read_header<Dialect>(input_reader, header, header_size);
+        apply_header(state, header);
+    }
+    size_t skipped_size = options.header == SkipHeader ? header_size : 0;
+    state.tokenizer.input_offset = skipped_size;
+    state.select_rows(options.rows);
+    if(options.rows_per_file != 0)
+        state.shard_rows(options.rows_per_file);
+    if(options.partitioning.partition_count != 0)
+    {
+        state.partition_rows(state.partitioning, mapped_input + mapped_size);
+        if(mapped_input != nullptr)
+            route_row<Dialect>(state, mapped_input + skipped_size);
+    }
+    if(options.index_interval != 0)
+        state.index_rows(options.index_interval);
+    
+    /// Anything read past the header has to be split before the rest of the input
+    if(skipped_size < header_input.size())
+        split_chunk<Dialect>(state, header_input.data() + skipped_size, header_input.size() - skipped_size);
+    
+    if(mapped_input != nullptr)
+    {
+        /// The tokenizer walks the mapping a chunk at a time so the masks stay small and in cache
+        split_chunk<Dialect>(state, mapped_input + skipped_size, mapped_size - skipped_size);
+        munmap(const_cast<uint8_t*>(mapped_input), mapped_size);
+    }
+    else if(queue_depth != 0)
+    {
+        /// The reader thread fills empty buffers and hands them over, the parser hands them back once split
+        RingBuffer<InputChunk> filled_chunks(queue_depth);
+        RingBuffer<uint8_t*> empty_buffers(queue_depth);
+        for(size_t i = 0; i < queue_depth; i++)
+            empty_buffers.push(state.arena.allocate(BUFFER_SIZE));
+        
+        std::atomic<bool> stop_reading(false); /// Set once every row wanted has been written
+        std::thread reader([&]()
+        {
+            while(true)
+            {
+                uint8_t* input_buffer = empty_buffers.pop();
+                ssize_t bytes_total = stop_reading.load(std::memory_order_relaxed) ? 0 : input_reader.read(input_buffer, BUFFER_SIZE);
+                if(__builtin_expect(bytes_total == -1, 0))
+                {
+                    /// Error with read
+                    perror("Error reading file");
+                    exit(1);
+                }
+                filled_chunks.push(InputChunk{input_buffer, bytes_total});
+                if(bytes_total == 0)
+                    break;
+            }
+        });
+        
+        while(true)
+        {
+            /// Reads may be short, particularly from pipes
+            InputChunk chunk = filled_chunks.pop();
+            if(chunk.size != 0 && !state.tokenizer.stopped)
+                split_chunk<Dialect>(state, chunk.buffer, chunk.size);
+            if(state.tokenizer.stopped)
+                stop_reading.store(true, std::memory_order_relaxed); /// Chunks already read are handed back unsplit
+            empty_buffers.push(chunk.buffer);
+            if(chunk.size == 0)
+                break;
+        }
+        
+        reader.join();
+        uint8_t* input_buffer;
+        while(empty_buffers.try_pop(input_buffer))
+            state.arena.release(input_buffer, BUFFER_SIZE);
+    }
+    else
+    {
+        uint8_t* input_buffer = state.arena.allocate(BUFFER_SIZE);
+        
+        while(!state.tokenizer.stopped)
+        {
+            ssize_t bytes_total = input_reader.read(input_buffer, BUFFER_SIZE); /// Bytes total represent's the input chunk size
+            if(__builtin_expect(bytes_total == -1, 0))
+            {
+                /// Error with read
+                perror("Error reading file");
+                exit(1);
+            }
+            else if(__builtin_expect(bytes_total == 0, 0))
+            {
+                /// No more data
+                break;
             }
             
-            /// Flush input buffer
-            if(input_buffer_on_heap)
-                free(input_buffer);
-            
+            /// Successfully got a chunk, reads may be short, particularly from pipes
+            split_chunk<Dialect>(state, input_buffer, bytes_total);
+        }
+        
+        state.arena.release(input_buffer, BUFFER_SIZE);
+    }
+    
+    /// Make sure every column has been output
+    finish_columns(state, options);
+    if(options.index_interval != 0)
+        write_row_index(state);
+    delete state.write_queue;
+    delete state.bounded_memory;
+    delete state.buffer_budget;
+#ifdef HAVE_LIBURING
+    delete state.uring_writer;
+#endif
+}
+
+/**
+ * Splits the input with the instantiation for the dialect picked in the options.
+ */
+void split_csv(int input_fd, std::string name, const SplitOptions& options = SplitOptions())
+{
+    switch(options.dialect)
+    {
+        case CsvInput:
+            split_input<CsvDialect>(input_fd, name, options);
+            break;
+        case TsvInput:
+            split_input<TsvDialect>(input_fd, name, options);
+            break;
+        case PipeInput:
+            split_input<PipeDialect>(input_fd, name, options);
+            break;
+        case SemicolonInput:
+            split_input<SemicolonDialect>(input_fd, name, options);
             break;
+    }
+}
+
+/**
+ * Each thread of a parallel split works on a segment of about this many bytes of input at a time.
+ */
+static const size_t SEGMENT_SIZE = 16*1024*1024;
+
+/**
+ * Follows only the quoting of the state machine over a span of input, without producing any output.
+ * Returns the state at the end of the span. row_start is set to just after the first newline that ends a row, or to
+ * end if no row ends inside the span.
+ */
+template<typename Dialect>
+CSVState skim_csv(const uint8_t* begin, const uint8_t* end, CSVState current_state, const uint8_t*& row_start)
+{
+    static const IndexChunkFunction index_chunk = select_index_chunk<Dialect>();
+    static const ResolveQuotesFunction resolve_quotes = select_resolve_quotes();
+    uint64_t separator_masks[BUFFER_SIZE/BLOCK_SIZE];
+    uint64_t quote_masks[BUFFER_SIZE/BLOCK_SIZE];
+    uint64_t field_separator_masks[BUFFER_SIZE/BLOCK_SIZE];
+    
+    row_start = end;
+    for(const uint8_t* chunk_begin = begin; chunk_begin != end;)
+    {
+        size_t bytes_total = std::min(BUFFER_SIZE, size_t(end - chunk_begin));
+        const uint8_t* chunk_end = chunk_begin + bytes_total;
+        index_chunk(chunk_begin, bytes_total, separator_masks, quote_masks);
+        
+        bool in_quotes = current_state == InQuotedStringColumn;
+        if(resolve_quotes(separator_masks, quote_masks, (bytes_total + BLOCK_SIZE - 1)/BLOCK_SIZE, field_separator_masks, 
+                          in_quotes, current_state == OnRowInitial || current_state == OnColumnInitial, current_state == InQuotedStringColumnOnQuote))
+        {
+            /// The quotes are well placed, so only the first row end and the last byte matter
+            for(const uint8_t* separator = chunk_begin; row_start == end; separator++)
+            {
+                separator = find_next_marked(field_separator_masks, chunk_begin, separator, chunk_end);
+                if(separator == chunk_end)
+                    break;
+                else if(*separator == '\n')
+                    row_start = separator + 1;
+            }
+            
+            current_state = resolved_end_state<Dialect>(in_quotes, *(chunk_end - 1));
         }
         else
         {
-            /// Successfully read a chunk - expect a full size chunk, if we don't get one we are at the end and we add sentinels
-            if(__builtin_expect(bytes_total != BUFFER_SIZE, 0))
+            /// Misplaced quotes, follow the state machine a byte at a time
+            for(const uint8_t* ptr = chunk_begin; ptr != chunk_end;)
             {
-                input_buffer[bytes_total] = '\n';
-                input_buffer[bytes_total + 1] = ',';
-                input_buffer[bytes_total + 2] = '"';
-                NEWLINE_SENTINEL = input_buffer + bytes_total;
-                COMMA_SENTINEL = input_buffer + bytes_total + 1;
-                DQUOTE_SENTINEL = input_buffer + bytes_total + 2;
+                ptr = skim_row<Dialect>(ptr, chunk_end, current_state);
+                if(current_state == OnRowInitial && row_start == end)
+                    row_start = ptr;
             }
-            
-            uint8_t* previous_ptr = input_buffer; /// Represents the one past last position where we last wrote or the beginning of a chunk.
-            /// Compute the next newline position and transform it into a comma if it's not the sentinel
-            if(current_state != OnRowInitial)
+        }
+        chunk_begin = chunk_end;
+    }
+    return current_state;
+}
+
+/**
+ * Appends everything an in-memory column has collected onto the end of another column.
+ */
+void append_column(ColumnInfo& column, const ColumnInfo& part)
+{
+    if(column.arrow != nullptr)
+    {
+        column.arrow->append(*part.arrow);
+        if(column.arrow->batch_full())
+            write_arrow_batch(column);
+        return;
+    }
+    else if(column.output_fd != -1 && column.write_queue == nullptr && column.uring_writer == nullptr && part.pending.size() >= column.buffer_size)
+    {
+        /// Large enough to write directly rather than copying it through the buffer
+        flush_buffer(column);
+        inspect_output(column, part.pending.data(), part.pending.size());
+        write_to_file(column, part.pending.data(), part.pending.size());
+    }
+    else if(!part.pending.empty())
+    {
+        copy_to_column(column, part.pending.data(), part.pending.size());
+    }
+    copy_to_column(column, part.buffer, part.buffer_position); /// The part has unquoted its fields already
+}
+
+/**
+ * Calls work(i) for each i in [0, count), each on its own thread.
+ */
+template<typename Work>
+void run_in_parallel(size_t count, Work work)
+{
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < count; i++)
+        threads.emplace_back(work, i);
+    work(0);
+    for(auto& t : threads)
+        t.join();
+}
+
+/**
+ * Splits a mapped file with several threads, the output is the same as split_csv.
+ * 
+ * The input is taken thread_count segments at a time. A segment boundary is placed just after a newline, and the
+ * state machine can only be in one of two states after a newline: at the start of a row, or inside a quoted string.
+ * Each thread skims its segment's quoting speculatively from both of these states. Chaining the results from the 
+ * first segment, whose state is known, then tells us where the first row of each segment really starts.
+ * 
+ * The first segment is split by the main state straight into the column files. The rest are split from the start of 
+ * their first row into in-memory columns, which start counting columns and rows from zero. They are appended to the
+ * column files in order afterwards, with blank lines for the columns a segment never reached. The last segment can 
+ * finish part way through a row, so its state is carried on to the next round.
+ */
+template<typename Dialect>
+void split_input_parallel(int input_fd, std::string name, const SplitOptions& options)
+{
+    size_t thread_count = options.thread_count;
+    if(!options.rows.selects_all() || options.rows_per_file != 0 || options.partitioning.partition_count != 0)
+    {
+        /// Whether a row is written depends on the rows before it, and the input may not be read to the end. Which file
+        /// a row goes in depends on the number of rows before it too, and partitioned rows swap their columns in.
+        split_input<Dialect>(input_fd, name, options);
+        return;
+    }
+    
+    size_t mapped_size = 0;
+    const uint8_t* mapped_input = map_uncompressed_input(input_fd, mapped_size);
+    if(mapped_input == nullptr)
+    {
+        /// Nothing to share out between the threads, or a compressed input that has to be read from its start
+        split_input<Dialect>(input_fd, name, options);
+        return;
+    }
+    
+    SplitState state(name);
+    state.selection = options.selection;
+    state.format = options.format;
+    state.statistics = options.statistics;
+    state.unquote = options.unquote;
+    state.compression = options.compression;
+    state.quote = Dialect::quote;
+    size_t offset = 0;
+    if(options.header != NoHeader)
+    {
+        std::vector<std::string> header;
+        const uint8_t* header_end = parse_header<Dialect>(mapped_input, mapped_input + mapped_size, true, header);
+        apply_header(state, header);
+        if(options.header == SkipHeader)
+            offset = header_end - mapped_input;
+    }
+    state.tokenizer.input_offset = offset;
+    if(options.index_interval != 0)
+        state.index_rows(options.index_interval);
+    
+    std::vector<const uint8_t*> segment_starts(thread_count + 1);
+    std::vector<const uint8_t*> row_starts(thread_count + 1);
+    std::vector<std::array<CSVState, 2>> end_states(thread_count);
+    std::vector<std::array<const uint8_t*, 2>> first_row_starts(thread_count);
+    while(offset != mapped_size)
+    {
+        const uint8_t* round_end = mapped_input + std::min(mapped_size, offset + thread_count*SEGMENT_SIZE);
+        segment_starts[0] = mapped_input + offset;
+        segment_starts[thread_count] = round_end;
+        for(size_t i = 1; i < thread_count; i++)
+        {
+            const uint8_t* nominal_start = std::min(round_end, mapped_input + offset + i*SEGMENT_SIZE);
+            const uint8_t* newline = static_cast<const uint8_t*>(memchr(nominal_start, '\n', round_end - nominal_start));
+            segment_starts[i] = newline == nullptr ? round_end : newline + 1;
+        }
+        
+        /// Skim each segment from both possible states, except the first whose state we already know
+        run_in_parallel(thread_count, [&](size_t i)
+        {
+            if(i == 0)
+            {
+                end_states[i][0] = skim_csv<Dialect>(segment_starts[i], segment_starts[i + 1], state.tokenizer.current_state, first_row_starts[i][0]);
+            }
+            else
+            {
+                end_states[i][0] = skim_csv<Dialect>(segment_starts[i], segment_starts[i + 1], OnRowInitial, first_row_starts[i][0]);
+                end_states[i][1] = skim_csv<Dialect>(segment_starts[i], segment_starts[i + 1], InQuotedStringColumn, first_row_starts[i][1]);
+            }
+        });
+        
+        /// Chain the states together to find where each segment's first row starts
+        CSVState segment_state = end_states[0][0];
+        row_starts[0] = segment_starts[0];
+        for(size_t i = 1; i < thread_count; i++)
+        {
+            if(segment_starts[i] == round_end)
             {
-                /// This is gated because if current_state == OnRowInitial then both searches for the
-                /// newline will go through, this is bad because we overwrite the newline character so we 
-                /// won't find the correct one.
-                next_newline = static_cast<uint8_t*>(rawmemchr(previous_ptr, '\n'));
-                if(next_newline != NEWLINE_SENTINEL)
-                    *next_newline = ',';
+                /// An empty segment at the end of the input, the state there could be anything
+                row_starts[i] = round_end;
+                continue;
             }
             
-            while(true)
+            assert(segment_state == OnRowInitial || segment_state == InQuotedStringColumn);
+            bool in_quotes = segment_state == InQuotedStringColumn;
+            row_starts[i] = in_quotes ? first_row_starts[i][1] : segment_starts[i];
+            segment_state = end_states[i][in_quotes];
+        }
+        
+        /// A segment with no row starting in it is split along with the segment before it
+        row_starts[thread_count] = round_end;
+        for(size_t i = thread_count - 1; i > 0; i--)
+        {
+            if(row_starts[i] >= segment_starts[i + 1])
+                row_starts[i] = row_starts[i + 1];
+        }
+        
+        /// Each part has its own arena, which takes its column buffers with it at the end of the round
+        std::vector<SplitState> parts;
+        parts.reserve(thread_count);
+        for(size_t i = 0; i < thread_count; i++)
+        {
+            parts.emplace_back("", true);
+            parts.back().selection = state.selection;
+            parts.back().format = state.format;
+            parts.back().unquote = state.unquote;
+            parts.back().quote = state.quote;
+            parts.back().tokenizer.input_offset = row_starts[i] - mapped_input;
+            if(state.index_interval != 0)
+                parts.back().index_rows(1); /// Which of their rows are due isn't known until the rows before are counted
+        }
+        run_in_parallel(thread_count, [&](size_t i)
+        {
+            split_chunk<Dialect>(i == 0 ? state : parts[i], row_starts[i], row_starts[i + 1] - row_starts[i]);
+        });
+        
+        /// Make room for any columns that only the later segments have
+        size_t column_count = state.column_infos.size();
+        for(size_t i = 1; i < thread_count; i++)
+            column_count = std::max(column_count, parts[i].column_infos.size());
+        while(state.column_infos.size() != column_count)
+            add_column(state, state.current_row);
+        
+        /// Append the segments to each column in order, different columns can be appended in parallel
+        assert(row_starts[1] == round_end || state.tokenizer.current_state == OnRowInitial);
+        run_in_parallel(thread_count, [&](size_t t)
+        {
+            for(size_t c = t; c < column_count; c += thread_count)
             {
-                state_begin:;
-                if(__builtin_expect(previous_ptr == NEWLINE_SENTINEL, 0))
-                    goto read_chunk; /// We are at the end of a chunk
-                
-                switch(current_state)
+                for(size_t i = 1; i < thread_count; i++)
                 {
-                    case OnRowInitial:
-                        /// We need to update the unread columns with newlines
-                        while(current_column != column_infos.size())
-                            add_chars_to_column(column_infos[current_column++], '\n', 1);
-                        current_column = 0;
-                        current_row++;
-                        /// Compute the next newline position and transform it into a comma if it's not the sentinel
-                        next_newline = static_cast<uint8_t*>(rawmemchr(previous_ptr, '\n'));
-            
-                        if(next_newline != NEWLINE_SENTINEL)
-                            *next_newline = ',';
-                        /// Note this falls through to OnColumnInitial
-                    case OnColumnInitial:
-                        if(__builtin_expect(*previous_ptr == '"', 0))
-                        {
-                            /// The beginning of a escaped string
-                            /// Create the column and add an opening "
-                            CHECK_AND_CREATE_COLUMN;
-                            add_chars_to_column(column_infos[current_column], '"', 1);
-                            
-                            previous_ptr++;
-                            current_state = InQuotedStringColumn;
-                            goto state_begin;
-                        }
-                        else if(__builtin_expect(*previous_ptr == ',', 0))
-                        {
-                            /// Empty column - or maybe the end of the line
-                            CHECK_AND_CREATE_COLUMN;
-                            if(__builtin_expect(previous_ptr == next_newline, 0))
-                            {
-                                /// This is an end of line
-                                
-                                /// Update position
-                                ++previous_ptr;
-                                
-                                // Go to OnRowInitial
-                                current_state = OnRowInitial;
-                                goto state_begin;
-                            }
-                            else
-                            {
-                                /// This is just an empty column
-                                
-                                /// Add a newline and update position
-                                add_chars_to_column(column_infos[current_column++], '\n', 1);
-                                ++previous_ptr;
-                                
-                                /// Go to OnColumnInitial
-                                current_state = OnColumnInitial;
-                                goto state_begin;
-                            }
-                        }
-                        else if(__builtin_expect(*previous_ptr == '\n', 0))
-                        {
-                            /// Empty column at end of line
-                            /// Write single newlines to remaining columns
-                            /// Newlines should be comma-ified
-                            assert(false);
-                        }
-                        else
-                        {
-                            /// A normal unescaped string column
-                            CHECK_AND_CREATE_COLUMN;
-                            current_state = InSimpleColumn;
-                            goto state_begin;
-                        }
-                        break;
-                    case InSimpleColumn:
-                    {
-                        /// Non-empty column non advanced string column
-                        uint8_t* next_column = static_cast<uint8_t*>(rawmemchr(previous_ptr, ','));
-                        int p = next_column - input_buffer;
-                        int n = next_newline - input_buffer;
-                        if(__builtin_expect(next_column == COMMA_SENTINEL, 0))
-                        {
-                            /// End of the chunk read 
-                            
-                            /// Write data to column
-                            size_t copy_size = std::distance(previous_ptr, input_buffer + BUFFER_SIZE);
-                            add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                            
-                            /// Continue reading the simple column on chunk_read
-                            current_state = InSimpleColumn;
-                            goto read_chunk;
-                        }
-                        else if(__builtin_expect(next_column == next_newline, 0))
-                        {
-                            /// End of a row
-                            
-                            /// Output till next_ptr
-                            size_t copy_size = std::distance(previous_ptr, next_column);
-                            add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                            add_chars_to_column(column_infos[current_column++], '\n', 1);
-                            
-                            /// Set state to row initial 
-                            previous_ptr = next_column + 1;
-                            current_state = OnRowInitial;
-                            goto state_begin;
-                        }
-                        else
-                        {
-                            /// End of a column
-                            
-                            /// Output till next_ptr
-                            size_t copy_size = std::distance(previous_ptr, next_column);
-                            add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                            add_chars_to_column(column_infos[current_column++], '\n', 1);
-                            
-                            /// Set state to column initial 
-                            previous_ptr = next_column + 1;
-                            current_state = OnColumnInitial;
-                            goto state_begin;
-                        }
-                        break;
-                    }
-                    case InQuotedStringColumnOnQuote:
-                        assert(false);
-                        if(*previous_ptr == '"')
-                        {
-                            /// Two quotes in a row - we actually just add a '"' to the column and proceed to InQuotedStringColumn
-                            current_state = InQuotedStringColumn;
-                            
-                            add_chars_to_column(column_infos[current_column], '"', 1);
-                            previous_ptr++;
-                            
-                            goto state_begin;
-                            
-                        }
-                        else if(*previous_ptr == ',')
-                        {
-                            /// A finishing quote was found at the end of the prior chunk - end the column and proceed to OnColumnInitial
-                            current_state = OnColumnInitial;
-                            
-                            add_chars_to_column(column_infos[current_column++], '\n', 1);
-                            previous_ptr++;
-                            
-                            goto state_begin;
-                        }
-                        else
-                        {
-                            /// No idea
-                            assert(false);
-                        }
-                        break;
-                    case InQuotedStringColumn:
-                    {
-                        /// Advanced string column
-                        /// NOTE: Handle newline in advanced string by checking if the end of the read is after the newline
-                        /// Represents the last read start, the last written position could be before this.
-                        uint8_t* last_read = previous_ptr;
-                        
-                        while(true)
-                        {
-                            /// The next ptr is where our read chunk ends - typically a hopefully ending double quote
-                            uint8_t* next_ptr = static_cast<uint8_t*>(rawmemchr(last_read, '"'));
-                            
-                            if(next_ptr > next_newline)
-                            {
-                                /// Check if we scanned past the newline sentinel - otherwise we revert it
-                                /// Revert the newline sentinel back to a newline even if it is the NEWLINE_SENTINEL
-                                *next_newline = '\n';
-                                /// Find the next newline position
-                                if(next_ptr < input_buffer + BUFFER_SIZE)
-                                {
-                                    /// Next ptr is still somewhere in the buffer - recompute the next newline position
-                                    /// If it wasn't then the chunk reload would hit the NEWLINE sentinel
-                                    next_newline = static_cast<uint8_t*>(rawmemchr(next_ptr, '\n'));
-                                    if(next_newline != NEWLINE_SENTINEL)
-                                        *next_newline = ',';
-                                }
-                            }
-                    
-                            if(__builtin_expect(next_ptr == DQUOTE_SENTINEL, 0))
-                            {
-                                /// We hit the end of the input block before we hit the end of the string
-                                /// Alter the state to reflect the ending state and save to the output buffer
-                                
-                                /// Write data to column
-                                size_t copy_size = std::distance(previous_ptr, input_buffer + BUFFER_SIZE);
-                                add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                                
-                                /// Trigger a chunk reload and continue from being in a quoted string
-                                current_state = InQuotedStringColumn;
-                                goto read_chunk;
-                            }
-                            else if(__builtin_expect(next_ptr == input_buffer + BUFFER_SIZE - 1, 0))
-                            {
-                                /// The double quote occurs on the buffer boundary
-                                /// That means we restart the search on with the double quoted string in mind
-                                
-                                /// Write data to column
-                                size_t copy_size = std::distance(previous_ptr, input_buffer + BUFFER_SIZE);
-                                add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                                
-                                /// Trigger a chunk reload and continue from the quoted string with prior quote char seen
-                                current_state = InQuotedStringColumnOnQuote;
-                                goto read_chunk;
-                            }
-                            else
-                            {
-                                /// This is a bonafide double quote, if a double quote follows it it is not an end
-                                if(*(next_ptr + 1) == '"')
-                                {
-                                    /// An escape sequence - we are still in a quoted string
-                                    last_read = next_ptr + 2;
-                                    
-                                    /// Trigger another iteration of the quote loop
-                                    continue;
-                                }
-                                else if(*(next_ptr + 1) == ',')
-                                {
-                                    /// An end of column - maybe a newline.
-                                    
-                                    /// Output till next_ptr                                    
-                                    size_t copy_size = std::distance(previous_ptr, next_ptr + 1);
-                                    add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                                    /// Update the column with a new line
-                                    add_chars_to_column(column_infos[current_column++], '\n', 1);
-
-                                    previous_ptr = next_ptr + 2;
-                                    
-                                    if(next_ptr + 1 == next_newline)
-                                    {
-                                        /// This is an end of line 
-                                        next_newline = static_cast<uint8_t*>(rawmemchr(next_newline + 1, '\n'));
-                                        if(next_newline != NEWLINE_SENTINEL)
-                                            *next_newline = ',';
-                                        
-                                        /// Go to the OnRowInitial state
-                                        current_state = OnRowInitial;
-                                        goto state_begin;
-                                    }
-                                    else
-                                    {
-                                        /// Go to the OnColumnInitial state
-                                        current_state = OnColumnInitial;
-                                        goto state_begin;
-                                    }
-                                }
-                                else
-                                {
-                                    /// No idea what that this is, but we treat as a non-quoted continuation of the string
-                                    /// This protects against trailing \r's
-                                    
-                                    /// Output till next_ptr                                    
-                                    size_t copy_size = std::distance(previous_ptr, next_ptr + 1);
-                                    add_buffer_to_column(column_infos[current_column], previous_ptr, copy_size);
-                                    previous_ptr = next_ptr + 1;
-                                    
-                                    /// Drop down to InSimpleColumn state
-                                    current_state = InSimpleColumn;
-                                    goto state_begin;
-                                }
-                            }
-                        }
-                    }
-                        break;
+                    if(c < parts[i].column_infos.size())
+                        append_column(state.column_infos[c], parts[i].column_infos[c]);
+                    else
+                        add_chars_to_column(state.column_infos[c], '\n', parts[i].current_row);
                 }
             }
-            
-            /// This is not really reachable
+        });
+        
+        /// Carry on from where the last segment finished
+        for(size_t i = 1; i < thread_count; i++)
+        {
+            if(row_starts[i] != row_starts[i + 1])
+            {
+                /// Row 0 of a part was indexed as the end of the part before it
+                for(size_t row = 1; state.index_interval != 0 && row <= parts[i].current_row; row++)
+                {
+                    if((state.current_row + row) % state.index_interval == 0)
+                        state.row_offsets.push_back(parts[i].row_offsets[row]);
+                }
+                state.current_row += parts[i].current_row;
+                
+                /// A field left part way through is kept by the tokenizer until it ends
+                state.tokenizer = std::move(parts[i].tokenizer);
+            }
         }
+        offset = round_end - mapped_input;
+        state.tokenizer.input_offset = offset;
+        if(state.index_interval != 0)
+            state.rows_until_index = state.index_interval - state.current_row % state.index_interval;
     }
+    
+    finish_split(state);
+    if(options.format == TypedOutput)
+        finish_typed_columns(state);
+    if(options.statistics)
+        finish_statistics(state);
+    if(options.index_interval != 0)
+        write_row_index(state);
+    munmap(const_cast<uint8_t*>(mapped_input), mapped_size);
 }
 
-
+/**
+ * Splits the input on several threads with the instantiation for the dialect picked in the options.
+ */
+void split_csv_parallel(int input_fd, std::string name, const SplitOptions& options)
+{
+    switch(options.dialect)
+    {
+        case CsvInput:
+            split_input_parallel<CsvDialect>(input_fd, name, options);
+            break;
+        case TsvInput:
+            split_input_parallel<TsvDialect>(input_fd, name, options);
+            break;
+        case PipeInput:
+            split_input_parallel<PipeDialect>(input_fd, name, options);
+            break;
+        case SemicolonInput:
+            split_input_parallel<SemicolonDialect>(input_fd, name, options);
+            break;
+    }
+}
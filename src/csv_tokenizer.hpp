@@ -0,0 +1,706 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+#include "dialect.hpp"
+#include "field_unquoter.hpp"
+#include "structural_index.hpp"
+
+/**
+ * The tokenizer on its own, for use outside of split_csv. It finds the fields and rows of delimited text and hands
+ * them to a sink, which is any class with these two members:
+ *
+ *     void on_field(size_t column, const uint8_t* ptr, size_t length, bool quoted);
+ *     void on_row_end();
+ *
+ * on_field gets each field in turn, counting the columns of a row from 0, exactly as it is in the input: a quoted
+ * field keeps its quotes and its doubled quotes, and quoted is set if it starts with one. The \r of a CRLF is not
+ * part of the field. on_row_end follows the last field of each row. The callbacks are called directly rather than
+ * through a virtual function, so the compiler inlines them into the state machine.
+ *
+ *     CsvTokenizer<CsvDialect, MySink> tokenizer(sink);
+ *     while((size = read(fd, buffer, sizeof(buffer))) > 0)
+ *         tokenizer.feed(buffer, size);
+ *     tokenizer.finish();
+ *
+ * A field usually points straight into the chunk that was fed in. One that carries on into the next chunk is gathered
+ * into a buffer of the tokenizer's first, so the sink always gets whole fields, and the pointer is only good until
+ * the callback returns.
+ */
+
+/// Allows us to write the code like a state machine and can stopped and resumed on buffer boundaries
+enum CSVState
+{
+    OnRowInitial, /// This means that we are at the start of a row
+    OnColumnInitial, /// This means that we are just after a delimiter
+    InSimpleColumn, /// This means that we write to the same column until we hit a delimiter
+    InQuotedStringColumn, /// This means that we are in a quoted string and we ended on a non-quote
+    InQuotedStringColumnOnQuote /// This means we are in a quoted string and we ended on a quote
+};
+
+/**
+ * The input is tokenized at most this many bytes at a time, so that the masks of a chunk stay small and in cache.
+ */
+static const size_t TOKENIZER_CHUNK_SIZE = 16*1024;
+
+/**
+ * Where a tokenizer is up to, kept from one chunk to the next. A sink can look at it from its callbacks, and from
+ * on_row_end it can also ask for rows to be passed over or for the tokenizing to stop.
+ */
+class TokenizerState
+{
+public:
+    CSVState current_state = OnRowInitial;
+    size_t current_column = 0; /// The field of the row that is being read, in on_row_end the number of fields the row had
+    uint64_t input_offset = 0; /// Where the chunk being tokenized starts in the input
+    const uint8_t* chunk = nullptr; /// The chunk being tokenized
+    const uint8_t* next_row = nullptr; /// In on_row_end, where the next row starts in the chunk
+    size_t rows_to_pass_over = 0; /// Rows to find the ends of without giving their fields to the sink
+    bool stopped = false; /// Once set, the rest of the input is left alone
+    std::vector<uint8_t> field; /// The start of a field that carries on from an earlier chunk
+    bool field_quoted = false; /// Whether the field being read started with a quote
+
+    TokenizerState()
+    {
+        field.reserve(BLOCK_SIZE); /// So that even an empty field has somewhere to point
+    }
+
+    /**
+     * In on_row_end, where the next row starts in the input.
+     */
+    uint64_t next_row_offset() const
+    {
+        return input_offset + (next_row - chunk);
+    }
+};
+
+/**
+ * Follows a row a byte at a time, only keeping track of the quoting of the state machine.
+ * Returns just past the newline that ends the row, with current_state back at OnRowInitial, or end if the row carries
+ * on past it.
+ */
+template<typename Dialect>
+const uint8_t* skim_row(const uint8_t* ptr, const uint8_t* end, CSVState& current_state)
+{
+    for(; ptr != end; ptr++)
+    {
+        switch(current_state)
+        {
+            case OnRowInitial:
+            case OnColumnInitial:
+                if(*ptr == Dialect::quote)
+                    current_state = InQuotedStringColumn;
+                else if(*ptr != Dialect::delimiter && *ptr != '\n')
+                    current_state = InSimpleColumn;
+                break;
+            case InSimpleColumn:
+                break;
+            case InQuotedStringColumn:
+                if(*ptr == Dialect::quote)
+                    current_state = InQuotedStringColumnOnQuote;
+                continue;
+            case InQuotedStringColumnOnQuote:
+                if(*ptr == Dialect::quote)
+                {
+                    current_state = InQuotedStringColumn;
+                    continue;
+                }
+                else if(*ptr != Dialect::delimiter && *ptr != '\n')
+                    current_state = InSimpleColumn;
+                break;
+        }
+
+        /// Outside of a quoted string delimiters and newlines always end the column
+        if(*ptr == Dialect::delimiter)
+        {
+            current_state = OnColumnInitial;
+        }
+        else if(*ptr == '\n')
+        {
+            current_state = OnRowInitial;
+            return ptr + 1;
+        }
+    }
+    return end;
+}
+
+/**
+ * The state at the end of a chunk whose quotes were resolved, from whether it ended inside quotes and its last byte.
+ */
+template<typename Dialect>
+CSVState resolved_end_state(bool in_quotes, uint8_t last_byte)
+{
+    if(in_quotes)
+        return InQuotedStringColumn;
+    else if(last_byte == Dialect::quote)
+        return InQuotedStringColumnOnQuote;
+    else if(last_byte == Dialect::delimiter)
+        return OnColumnInitial;
+    else if(last_byte == '\n')
+        return OnRowInitial;
+    return InSimpleColumn;
+}
+
+/**
+ * Runs the state machine over the input and gives the fields and row ends to a Sink, see above.
+ * Every Dialect gets its own instantiation, with its delimiter and quote compiled in, and every Sink gets its own
+ * copy of the state machine with the callbacks inlined into it. The state is kept in a TokenizerState, which is the
+ * tokenizer's own unless one is given, so a tokenizer can also be made for each chunk over a state that outlives it.
+ */
+template<typename Dialect, typename Sink>
+class CsvTokenizer
+{
+public:
+    explicit CsvTokenizer(Sink& sink) : sink(sink), state(own_state)
+    {
+    }
+
+    CsvTokenizer(Sink& sink, TokenizerState& state) : sink(sink), state(state)
+    {
+    }
+
+    CsvTokenizer(const CsvTokenizer&) = delete;
+    CsvTokenizer& operator=(const CsvTokenizer&) = delete;
+
+    /**
+     * Tokenizes the next size bytes of the input. The input is never written to, so it may point directly into a
+     * read-only mapping, and it isn't needed once this returns.
+     */
+    void feed(const uint8_t* input, size_t size)
+    {
+        while(size != 0 && !state.stopped)
+        {
+            size_t chunk_size = std::min(size, TOKENIZER_CHUNK_SIZE);
+            tokenize_chunk(input, chunk_size);
+            input += chunk_size;
+            size -= chunk_size;
+        }
+    }
+
+    /**
+     * Ends the input. A row that it stops part way through is ended as if a newline followed, and a \r at the very
+     * end is dropped like the \r of a CRLF.
+     */
+    void finish()
+    {
+        if(state.current_state != OnRowInitial && state.rows_to_pass_over == 0 && !state.stopped)
+        {
+            if(state.current_state == InSimpleColumn && !state.field.empty() && state.field.back() == '\r')
+                state.field.pop_back();
+            sink.on_field(state.current_column++, state.field.data(), state.field.size(), state.field_quoted);
+            state.chunk = state.next_row = nullptr;
+            sink.on_row_end();
+        }
+        state.field.clear();
+        state.current_column = 0;
+        state.current_state = OnRowInitial;
+    }
+
+    /**
+     * From on_row_end, passes over the next count rows without giving their fields to the sink. on_row_end is still
+     * called once they have been passed over, with no fields, so the sink knows where the next row starts.
+     */
+    void pass_over_rows(size_t count)
+    {
+        state.rows_to_pass_over += count;
+    }
+
+    /**
+     * From on_row_end, leaves the rest of the input alone.
+     */
+    void stop()
+    {
+        state.stopped = true;
+    }
+
+private:
+    Sink& sink;
+    TokenizerState own_state;
+    TokenizerState& state;
+
+    /**
+     * Gives a field that ends at begin + length to the sink, after whatever of it came in earlier chunks.
+     */
+    void end_field(size_t column, const uint8_t* begin, size_t length, bool quoted, bool& field_carried)
+    {
+        if(__builtin_expect(field_carried, 0))
+        {
+            state.field.insert(state.field.end(), begin, begin + length);
+            sink.on_field(column, state.field.data(), state.field.size(), quoted);
+            state.field.clear();
+            field_carried = false;
+            return;
+        }
+        sink.on_field(column, begin, length, quoted);
+    }
+
+    /**
+     * Passes over rows from ptr, following them only far enough to find their ends. If the chunk's quotes are
+     * resolved, field_end_masks has its field separators and each newline is found with memchr and checked against
+     * them, otherwise field_end_masks is null and the rows are followed a byte at a time.
+     * Returns true with ptr at the start of the next row, or false if the chunk ran out first.
+     */
+    bool pass_over(const uint8_t*& ptr, CSVState& current_state, const uint8_t* chunk_begin, const uint8_t* chunk_end,
+        const uint64_t* field_end_masks, bool in_quotes)
+    {
+        while(state.rows_to_pass_over != 0)
+        {
+            if(ptr == chunk_end)
+                return false;
+
+            if(field_end_masks != nullptr)
+            {
+                const uint8_t* newline = static_cast<const uint8_t*>(memchr(ptr, '\n', chunk_end - ptr));
+                while(newline != nullptr && !is_marked(field_end_masks, chunk_begin, newline))
+                    newline = static_cast<const uint8_t*>(memchr(newline + 1, '\n', chunk_end - newline - 1));
+                if(newline == nullptr)
+                {
+                    current_state = resolved_end_state<Dialect>(in_quotes, *(chunk_end - 1));
+                    ptr = chunk_end;
+                    return false;
+                }
+                ptr = newline + 1;
+                current_state = OnRowInitial;
+            }
+            else
+            {
+                ptr = skim_row<Dialect>(ptr, chunk_end, current_state);
+                if(current_state != OnRowInitial)
+                    return false;
+            }
+            state.rows_to_pass_over--;
+        }
+        return true;
+    }
+
+    /**
+     * This is the main loop of the tokenizer, it runs the state machine over one chunk of input.
+     *   Find the end of each field
+     *     If it ends in this chunk
+     *       Give it to the sink
+     *     Otherwise keep what there is of it for the next chunk
+     * The state is saved when the chunk runs out so the next chunk carries on from where this one stopped. Chunks are
+     * at most TOKENIZER_CHUNK_SIZE bytes.
+     */
+    void tokenize_chunk(const uint8_t* chunk_begin, size_t bytes_total)
+    {
+        /// The structural character masks of the chunk
+        static const IndexChunkFunction index_chunk = select_index_chunk<Dialect>();
+        static const ResolveQuotesFunction resolve_quotes = select_resolve_quotes();
+        uint64_t separator_masks[TOKENIZER_CHUNK_SIZE/BLOCK_SIZE];
+        uint64_t quote_masks[TOKENIZER_CHUNK_SIZE/BLOCK_SIZE];
+        uint64_t field_separator_masks[TOKENIZER_CHUNK_SIZE/BLOCK_SIZE]; /// Separators that are outside of quoted strings
+        size_t current_column = state.current_column;
+        CSVState current_state = state.current_state;
+        bool field_quoted = state.field_quoted;
+        bool field_carried = !state.field.empty(); /// Whether the field being read started in an earlier chunk
+        state.chunk = chunk_begin;
+
+        const uint8_t* previous_ptr = chunk_begin; /// Where the state machine has read up to
+        const uint8_t* field_begin = chunk_begin; /// Where the part of the field being read that is in this chunk begins
+        const uint8_t* chunk_end = chunk_begin + bytes_total; /// One past the last byte of the current chunk
+        index_chunk(chunk_begin, bytes_total, separator_masks, quote_masks);
+
+        /// When the quotes in a chunk are well placed every field, quoted or not, simply ends at the next field
+        /// separator and is handled by InSimpleColumn. Otherwise we fall back to following the quotes one by one.
+        bool in_quotes = current_state == InQuotedStringColumn;
+        bool quotes_resolved = resolve_quotes(separator_masks, quote_masks, (bytes_total + BLOCK_SIZE - 1)/BLOCK_SIZE, field_separator_masks,
+                                              in_quotes, current_state == OnRowInitial || current_state == OnColumnInitial, current_state == InQuotedStringColumnOnQuote);
+        const uint64_t* field_end_masks = quotes_resolved ? field_separator_masks : separator_masks;
+        if(quotes_resolved && (current_state == InQuotedStringColumn || current_state == InQuotedStringColumnOnQuote))
+            current_state = InSimpleColumn;
+        if(__builtin_expect(state.rows_to_pass_over != 0, 0))
+            goto pass_over_rows; /// Carry on passing over rows from the last chunk
+
+        while(true)
+        {
+            state_begin:;
+            if(__builtin_expect(previous_ptr == chunk_end, 0))
+                goto end_of_chunk; /// We are at the end of a chunk
+
+            switch(current_state)
+            {
+                case OnRowInitial:
+                case OnColumnInitial:
+                    field_begin = previous_ptr;
+                    field_quoted = *previous_ptr == Dialect::quote;
+                    if(__builtin_expect(field_quoted && !quotes_resolved, 0))
+                    {
+                        /// The beginning of a escaped string
+                        previous_ptr++;
+                        current_state = InQuotedStringColumn;
+                        goto state_begin;
+                    }
+                    else if(__builtin_expect(*previous_ptr == Dialect::delimiter, 0))
+                    {
+                        /// This is just an empty column
+                        sink.on_field(current_column++, previous_ptr, 0, false);
+                        ++previous_ptr;
+
+                        /// Go to OnColumnInitial
+                        current_state = OnColumnInitial;
+                        goto state_begin;
+                    }
+                    else if(__builtin_expect(*previous_ptr == '\n', 0))
+                    {
+                        /// Empty column at end of line
+                        sink.on_field(current_column++, previous_ptr, 0, false);
+                        ++previous_ptr;
+                        goto end_of_row;
+                    }
+                    else
+                    {
+                        /// A normal unescaped string column
+                        current_state = InSimpleColumn;
+                        goto state_begin;
+                    }
+                    break;
+                case InSimpleColumn:
+                {
+                    /// Non-empty column non advanced string column
+                    /// With resolved quotes this may also be a quoted column
+                    const uint8_t* next_separator = find_next_marked(field_end_masks, chunk_begin, previous_ptr, chunk_end);
+                    if(__builtin_expect(next_separator == chunk_end, 0))
+                    {
+                        /// End of the chunk read
+
+                        /// Continue reading the column on chunk_read, in whichever state the quotes left us
+                        if(quotes_resolved && in_quotes)
+                            current_state = InQuotedStringColumn;
+                        else if(quotes_resolved && *(chunk_end - 1) == Dialect::quote)
+                            current_state = InQuotedStringColumnOnQuote;
+                        else
+                            current_state = InSimpleColumn;
+                        goto end_of_chunk;
+                    }
+
+                    /// Give the field up to the separator, at the end of a row the \r of a CRLF is part of the terminator
+                    size_t copy_size = std::distance(field_begin, next_separator);
+                    if(__builtin_expect(*next_separator == '\n', 0))
+                    {
+                        if(copy_size != 0 && *(next_separator - 1) == '\r')
+                            copy_size--;
+                        else if(copy_size == 0 && field_carried && state.field.back() == '\r')
+                            state.field.pop_back(); /// The last chunk ended between the \r and the newline
+                    }
+                    end_field(current_column++, field_begin, copy_size, field_quoted, field_carried);
+                    previous_ptr = next_separator + 1;
+
+                    if(__builtin_expect(*next_separator == Dialect::delimiter, 1))
+                    {
+                        /// End of a column
+                        current_state = OnColumnInitial;
+                        goto state_begin;
+                    }
+                    else
+                    {
+                        /// End of a row
+                        goto end_of_row;
+                    }
+                    break;
+                }
+                case InQuotedStringColumnOnQuote:
+                    if(*previous_ptr == Dialect::quote)
+                    {
+                        /// Two quotes in a row - the field carries on and we proceed to InQuotedStringColumn
+                        current_state = InQuotedStringColumn;
+                        previous_ptr++;
+                        goto state_begin;
+                    }
+                    else if(*previous_ptr == Dialect::delimiter)
+                    {
+                        /// A finishing quote was found at the end of the prior chunk - end the column and proceed to OnColumnInitial
+                        current_state = OnColumnInitial;
+                        end_field(current_column++, field_begin, 0, field_quoted, field_carried);
+                        previous_ptr++;
+                        goto state_begin;
+                    }
+                    else if(*previous_ptr == '\n')
+                    {
+                        /// A finishing quote was found at the end of the prior chunk and it also ended the row
+                        end_field(current_column++, field_begin, 0, field_quoted, field_carried);
+                        previous_ptr++;
+                        goto end_of_row;
+                    }
+                    else
+                    {
+                        /// No idea what that this is, but we treat as a non-quoted continuation of the string
+                        current_state = InSimpleColumn;
+                        goto state_begin;
+                    }
+                    break;
+                case InQuotedStringColumn:
+                {
+                    /// Advanced string column
+                    /// Represents the last read start, the field itself starts before this.
+                    const uint8_t* last_read = previous_ptr;
+
+                    while(true)
+                    {
+                        /// The next ptr is where our read chunk ends - typically a hopefully ending double quote
+                        const uint8_t* next_ptr = find_next_marked(quote_masks, chunk_begin, last_read, chunk_end);
+
+                        if(__builtin_expect(next_ptr == chunk_end, 0))
+                        {
+                            /// We hit the end of the input block before we hit the end of the string
+                            /// Finish the chunk and continue from being in a quoted string
+                            current_state = InQuotedStringColumn;
+                            goto end_of_chunk;
+                        }
+                        else if(__builtin_expect(next_ptr == chunk_end - 1, 0))
+                        {
+                            /// The double quote occurs on the buffer boundary
+                            /// Finish the chunk and continue from the quoted string with prior quote char seen
+                            current_state = InQuotedStringColumnOnQuote;
+                            goto end_of_chunk;
+                        }
+                        else
+                        {
+                            /// This is a bonafide double quote, if a double quote follows it it is not an end
+                            if(*(next_ptr + 1) == Dialect::quote)
+                            {
+                                /// An escape sequence - we are still in a quoted string
+                                last_read = next_ptr + 2;
+
+                                /// Trigger another iteration of the quote loop
+                                continue;
+                            }
+
+                            /// Give the field up to and including the quote
+                            size_t copy_size = std::distance(field_begin, next_ptr + 1);
+                            if(*(next_ptr + 1) == Dialect::delimiter)
+                            {
+                                /// An end of column
+                                end_field(current_column++, field_begin, copy_size, field_quoted, field_carried);
+                                previous_ptr = next_ptr + 2;
+
+                                /// Go to the OnColumnInitial state
+                                current_state = OnColumnInitial;
+                                goto state_begin;
+                            }
+                            else if(*(next_ptr + 1) == '\n')
+                            {
+                                /// An end of column and an end of line
+                                end_field(current_column++, field_begin, copy_size, field_quoted, field_carried);
+                                previous_ptr = next_ptr + 2;
+                                goto end_of_row;
+                            }
+                            else
+                            {
+                                /// No idea what that this is, but we treat as a non-quoted continuation of the string
+                                /// InSimpleColumn then drops the \r of a CRLF after a closing quote
+                                previous_ptr = next_ptr + 1;
+
+                                /// Drop down to InSimpleColumn state
+                                current_state = InSimpleColumn;
+                                goto state_begin;
+                            }
+                        }
+                    }
+                }
+                    break;
+            }
+
+            end_of_row:;
+            state.current_column = current_column;
+            state.next_row = previous_ptr;
+            sink.on_row_end();
+            current_column = 0;
+
+            /// Go to OnRowInitial
+            current_state = OnRowInitial;
+            if(__builtin_expect(state.rows_to_pass_over != 0 || state.stopped, 0))
+            {
+                if(state.stopped)
+                {
+                    /// The rest of the input is left alone
+                    bytes_total = std::distance(chunk_begin, previous_ptr);
+                    goto end_of_chunk;
+                }
+                goto pass_over_rows;
+            }
+            continue;
+
+            pass_over_rows:;
+            if(!pass_over(previous_ptr, current_state, chunk_begin, chunk_end, quotes_resolved ? field_end_masks : nullptr, in_quotes))
+                goto end_of_chunk;
+            goto end_of_row; /// With no fields
+        }
+
+        end_of_chunk:;
+        if(current_state != OnRowInitial && current_state != OnColumnInitial && state.rows_to_pass_over == 0 && !state.stopped)
+            state.field.insert(state.field.end(), field_begin, chunk_end); /// Kept until the field ends in a later chunk
+        state.current_column = current_column;
+        state.current_state = current_state;
+        state.field_quoted = field_quoted;
+        state.input_offset += bytes_total;
+    }
+};
+
+/**
+ * A field given out by CsvFieldReader, as its value: a quoted field has lost its quotes and its doubled quotes.
+ */
+class CsvField
+{
+public:
+    size_t row; /// The row of the input, counting from 0
+    size_t column; /// The field of the row, counting from 0
+    const uint8_t* data;
+    size_t size;
+};
+
+/**
+ * Reads the fields of an input that is all in memory, such as a mapped file, one at a time and only when they are
+ * asked for, so the caller drives the parsing and can stop whenever it likes:
+ *
+ *     CsvFieldReader<CsvDialect> reader(input, input + input_size);
+ *     CsvField field;
+ *     while(reader.next(field))
+ *         ...
+ *
+ * The input is tokenized a chunk at a time by the usual state machine into a batch of fields, which next() then hands
+ * out, so there is no callback for each field. The value of an unquoted field, or of a quoted one with no doubled
+ * quotes in it, points straight into the input and is good for as long as the input is. The few values that have to
+ * be put together, those with doubled quotes and those that span two chunks, are only good until the next call.
+ */
+template<typename Dialect>
+class CsvFieldReader
+{
+public:
+    CsvFieldReader(const uint8_t* begin, const uint8_t* end) : position(begin), input_end(end), sink{*this}, tokenizer(sink, state)
+    {
+        fields.resize(TOKENIZER_CHUNK_SIZE + 1); /// Every field but the last ends on a separator of the chunk
+    }
+
+    /**
+     * Sets field to the next field of the input.
+     * Returns false once every field has been read.
+     */
+    bool next(CsvField& field)
+    {
+        while(next_field == field_count)
+        {
+            if(finished)
+                return false;
+            read_chunk();
+        }
+
+        const PendingField& pending = fields[next_field++];
+        const uint8_t* data = pending.data != nullptr ? pending.data : gathered.data();
+        current_row += pending.column == 0; /// Every row has at least one field
+        field.row = current_row - 1;
+        field.column = pending.column;
+        if(__builtin_expect(!pending.quoted, 1))
+        {
+            field.data = data;
+            field.size = pending.size;
+        }
+        else if(pending.size >= 2 && data[pending.size - 1] == Dialect::quote &&
+                memchr(data + 1, Dialect::quote, pending.size - 2) == nullptr)
+        {
+            /// Nothing between the quotes needs changing
+            field.data = data + 1;
+            field.size = pending.size - 2;
+        }
+        else
+        {
+            value.clear();
+            FieldUnquoter unquoter(false, Dialect::quote);
+            ValueOutput output{value};
+            unquoter.add(data, pending.size, output);
+            field.data = value.data();
+            field.size = value.size();
+        }
+        return true;
+    }
+
+private:
+    /**
+     * A field of the batch, exactly as it is in the input.
+     */
+    class PendingField
+    {
+    public:
+        const uint8_t* data; /// Null if the field was gathered by the tokenizer, it is then copied to gathered
+        size_t size;
+        size_t column;
+        bool quoted;
+    };
+
+    /**
+     * Adds the tokenizer's fields to the batch.
+     */
+    class BatchSink
+    {
+    public:
+        CsvFieldReader& reader;
+
+        void on_field(size_t column, const uint8_t* ptr, size_t length, bool quoted)
+        {
+            reader.add_field(column, ptr, length, quoted);
+        }
+
+        void on_row_end()
+        {
+        }
+    };
+
+    /**
+     * Where the unquoter writes a value.
+     */
+    class ValueOutput
+    {
+    public:
+        std::vector<uint8_t>& value;
+
+        void operator()(const uint8_t* ptr, size_t size)
+        {
+            value.insert(value.end(), ptr, ptr + size);
+        }
+    };
+
+    const uint8_t* position; /// Where the next chunk starts
+    const uint8_t* input_end;
+    size_t current_row = 0; /// The number of rows that fields have been given out from
+    bool finished = false; /// Whether the last field has been put in the batch
+    std::vector<PendingField> fields; /// The batch of fields from the last chunk
+    size_t field_count = 0;
+    size_t next_field = 0; /// The next field of the batch to give out
+    std::vector<uint8_t> gathered; /// The field of the batch that the tokenizer gathered from two chunks, if there was one
+    std::vector<uint8_t> value; /// The last value that had to be unquoted
+    TokenizerState state;
+    BatchSink sink;
+    CsvTokenizer<Dialect, BatchSink> tokenizer;
+
+    void add_field(size_t column, const uint8_t* ptr, size_t length, bool quoted)
+    {
+        if(__builtin_expect(ptr == state.field.data() && length != 0, 0))
+        {
+            /// The tokenizer's copy is reused once this returns. Only a chunk's first field can have been gathered.
+            gathered.assign(ptr, ptr + length);
+            ptr = nullptr;
+        }
+        fields[field_count++] = PendingField{ptr, length, column, quoted};
+    }
+
+    /**
+     * Replaces the batch with the fields of the next chunk, or with the last field if the input has run out.
+     */
+    void read_chunk()
+    {
+        field_count = 0;
+        gathered.clear();
+        next_field = 0;
+        if(position == input_end)
+        {
+            tokenizer.finish();
+            finished = true;
+            return;
+        }
+        size_t chunk_size = std::min(TOKENIZER_CHUNK_SIZE, size_t(input_end - position));
+        tokenizer.feed(position, chunk_size);
+        position += chunk_size;
+    }
+};
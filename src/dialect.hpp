@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * A dialect of delimited text, given by the character between fields and the character that quotes a field.
+ * Both are compile time constants, so the classifier and the state machine compare against immediates and every
+ * dialect gets a hot loop of its own. Records end with a newline, and a quote inside a quoted field is escaped by
+ * doubling it, as in RFC 4180.
+ */
+template<uint8_t Delimiter, uint8_t Quote = '"'>
+class Dialect
+{
+public:
+    static const uint8_t delimiter = Delimiter;
+    static const uint8_t quote = Quote;
+};
+
+typedef Dialect<','> CsvDialect;
+typedef Dialect<'\t'> TsvDialect;
+typedef Dialect<'|'> PipeDialect;
+typedef Dialect<';'> SemicolonDialect;
+
+/**
+ * The dialects that can be picked when running, each is instantiated separately.
+ */
+enum InputDialect
+{
+    CsvInput,
+    TsvInput,
+    PipeInput,
+    SemicolonInput
+};
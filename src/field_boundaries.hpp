@@ -0,0 +1,135 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Finds where the fields end in a column's output, which is the fields each followed by a newline.
+ * A newline inside a quoted field is part of the field, so this follows the quoting the same way the state machine
+ * does: a field that starts with a quote runs to the closing quote, and anything after that carries on the
+ * field up to the next newline. The output may be fed in pieces of any size.
+ * Unquoted output has no quoting to follow, every newline ends a field.
+ */
+class FieldBoundaries
+{
+public:
+    static const int NO_QUOTE = -1; /// The quote of output that has been unquoted
+    
+    explicit FieldBoundaries(int quote = '"') : quote(quote)
+    {
+    }
+
+    bool at_field_start() const
+    {
+        return field_state == AtFieldStart;
+    }
+
+    /**
+     * Whether the field being scanned started with a quote.
+     */
+    bool quoted() const
+    {
+        return field_quoted;
+    }
+
+    /**
+     * Scans the field that carries on at ptr. Returns the newline that ends it, with field_ended set, or end with
+     * field_ended clear if the field carries on past end.
+     */
+    const uint8_t* next_piece(const uint8_t* ptr, const uint8_t* end, bool& field_ended)
+    {
+        field_ended = false;
+        while(ptr != end)
+        {
+            switch(field_state)
+            {
+                case AtFieldStart:
+                    field_quoted = *ptr == quote;
+                    if(field_quoted)
+                    {
+                        field_state = InQuoted;
+                        ptr++;
+                        break;
+                    }
+                    field_state = InUnquoted;
+                    break;
+                case InUnquoted:
+                {
+                    if(end - ptr >= 8)
+                    {
+                        /// Most fields are short, so look for the newline in the next 8 bytes before calling memchr
+                        uint64_t bytes;
+                        memcpy(&bytes, ptr, sizeof(bytes));
+                        bytes ^= 0x0A0A0A0A0A0A0A0AULL;
+                        uint64_t newlines = (bytes - 0x0101010101010101ULL) & ~bytes & 0x8080808080808080ULL;
+                        if(newlines != 0)
+                        {
+                            field_state = AtFieldStart;
+                            field_ended = true;
+                            return ptr + __builtin_ctzll(newlines)/8;
+                        }
+                        ptr += 8;
+                    }
+                    const uint8_t* newline = static_cast<const uint8_t*>(memchr(ptr, '\n', end - ptr));
+                    if(newline == nullptr)
+                        return end;
+                    field_state = AtFieldStart;
+                    field_ended = true;
+                    return newline;
+                }
+                case InQuoted:
+                {
+                    const uint8_t* next_quote = static_cast<const uint8_t*>(memchr(ptr, quote, end - ptr));
+                    if(next_quote == nullptr)
+                        return end;
+                    field_state = InQuotedOnQuote;
+                    ptr = next_quote + 1;
+                    break;
+                }
+                case InQuotedOnQuote:
+                    if(*ptr == quote)
+                    {
+                        /// An escaped quote
+                        field_state = InQuoted;
+                        ptr++;
+                    }
+                    else if(*ptr == '\n')
+                    {
+                        field_state = AtFieldStart;
+                        field_ended = true;
+                        return ptr;
+                    }
+                    else
+                    {
+                        /// Like the state machine, anything after the closing quote carries on the field
+                        field_state = InUnquoted;
+                    }
+                    break;
+            }
+        }
+        return end;
+    }
+
+    /**
+     * Called after the last of the output. Returns true if a field was still open, which can only be a quoted field
+     * that was never closed. The newline that ended the column ended that field as well.
+     */
+    bool finish()
+    {
+        bool field_open = field_state != AtFieldStart;
+        field_state = AtFieldStart;
+        return field_open;
+    }
+
+private:
+    enum FieldState
+    {
+        AtFieldStart,
+        InUnquoted,
+        InQuoted,
+        InQuotedOnQuote /// In a quoted field just after a quote, which may be the first of an escaped pair
+    };
+
+    int quote;
+    FieldState field_state = AtFieldStart;
+    bool field_quoted = false;
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Turns the fields of a column, given exactly as they are in the input, into their values. A field that starts with a
+ * quote loses its surrounding quotes and has each doubled quote collapsed, anything after the closing quote is
+ * kept as it is, like the state machine does. Unquoted fields are values already.
+ * Fields may be given in pieces of any size. Their ends are given separately, as a newline in a field is always part
+ * of a quoted value. With escape set, backslashes and newlines in values are written as \\ and \n so that every value
+ * stays on a line of its own.
+ */
+class FieldUnquoter
+{
+public:
+    FieldUnquoter(bool escape, uint8_t quote = '"') : escape(escape), quote(quote)
+    {
+    }
+
+    /**
+     * Adds the next piece of the current field, passing the value's bytes to output(ptr, size) in runs.
+     */
+    template<typename Output>
+    void add(const uint8_t* ptr, size_t size, Output& output)
+    {
+        static const uint8_t escaped_backslash[2] = {'\\', '\\'};
+        static const uint8_t escaped_newline[2] = {'\\', 'n'};
+        const uint8_t* end = ptr + size;
+        while(ptr != end)
+        {
+            switch(field_state)
+            {
+                case AtFieldStart:
+                    if(*ptr == quote)
+                    {
+                        field_state = InQuoted;
+                        ptr++;
+                        break;
+                    }
+                    field_state = InUnquoted;
+                    break;
+                case InUnquoted:
+                case InQuoted:
+                    ptr = copy_plain(ptr, end, output);
+                    if(ptr == end)
+                        break;
+                    else if(*ptr == quote && field_state == InQuoted)
+                        field_state = InQuotedOnQuote;
+                    else if(*ptr == '\\')
+                        output(escaped_backslash, sizeof(escaped_backslash));
+                    else
+                        output(escaped_newline, sizeof(escaped_newline));
+                    ptr++;
+                    break;
+                case InQuotedOnQuote:
+                    if(*ptr == quote)
+                    {
+                        /// An escaped quote
+                        output(&quote, 1);
+                        field_state = InQuoted;
+                        ptr++;
+                        break;
+                    }
+                    field_state = InUnquoted;
+                    break;
+            }
+        }
+    }
+
+    void end_field()
+    {
+        field_state = AtFieldStart;
+    }
+
+private:
+    enum FieldState
+    {
+        AtFieldStart,
+        InUnquoted,
+        InQuoted,
+        InQuotedOnQuote /// In a quoted field just after a quote, which may be the first of an escaped pair
+    };
+
+    bool escape;
+    uint8_t quote;
+    FieldState field_state = AtFieldStart;
+
+    /**
+     * Passes on the bytes from ptr up to the first one that needs more than copying, and returns where that is.
+     * That is a quote in a quoted field, or a backslash or newline when escaping.
+     */
+    template<typename Output>
+    const uint8_t* copy_plain(const uint8_t* ptr, const uint8_t* end, Output& output)
+    {
+        bool quoted = field_state == InQuoted;
+        if(!quoted && !escape)
+        {
+            output(ptr, end - ptr);
+            return end;
+        }
+
+        /// Characters that can't stop the copy are stood in for by one that can
+        uint8_t quote_stop = quoted ? quote : '\n';
+        uint8_t backslash_stop = escape ? '\\' : quote_stop;
+        uint8_t newline_stop = escape ? '\n' : quote_stop;
+        const uint8_t* start = ptr;
+#if defined(__x86_64__)
+        /// 16 bytes are checked at a time, the run is then passed on in one go
+        __m128i quotes = _mm_set1_epi8(char(quote_stop));
+        __m128i backslashes = _mm_set1_epi8(char(backslash_stop));
+        __m128i newlines = _mm_set1_epi8(char(newline_stop));
+        for(; end - ptr >= 16; ptr += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+            __m128i stops = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quotes), _mm_cmpeq_epi8(bytes, backslashes)),
+                                         _mm_cmpeq_epi8(bytes, newlines));
+            unsigned stop_mask = _mm_movemask_epi8(stops);
+            if(stop_mask != 0)
+            {
+                ptr += __builtin_ctz(stop_mask);
+                output(start, ptr - start);
+                return ptr;
+            }
+        }
+#endif
+        while(ptr != end && *ptr != quote_stop && *ptr != backslash_stop && *ptr != newline_stop)
+            ptr++;
+        output(start, ptr - start);
+        return ptr;
+    }
+};
@@ -0,0 +1,339 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+
+/**
+ * How the input is compressed, told from the magic bytes at its start.
+ */
+enum InputCompression
+{
+    PlainInput,
+    GzipInput,
+    ZstdInput,
+    Bzip2Input
+};
+
+/**
+ * Enough of the start of the input to tell how it is compressed.
+ */
+static const size_t COMPRESSION_MAGIC_SIZE = 10;
+
+/**
+ * The first bytes of every gzip member.
+ */
+static const uint8_t GZIP_MAGIC[] = {0x1f, 0x8b};
+
+/**
+ * Tells how the input that starts with the size bytes at data is compressed. gzip and zstd start with bytes that
+ * can't begin a UTF-8 text, but "BZh" followed by a digit could, so for bzip2 the magic of the first block is checked
+ * as well.
+ */
+inline InputCompression input_compression(const uint8_t* data, size_t size)
+{
+    static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    static const uint8_t bzip2_block_magic[] = {0x31, 0x41, 0x59, 0x26, 0x53, 0x59};
+    static const uint8_t bzip2_end_magic[] = {0x17, 0x72, 0x45, 0x38, 0x50, 0x90}; /// An empty stream
+    if(size >= sizeof(GZIP_MAGIC) && memcmp(data, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0)
+        return GzipInput;
+    if(size >= sizeof(zstd_magic) && memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0)
+        return ZstdInput;
+    if(size >= COMPRESSION_MAGIC_SIZE && memcmp(data, "BZh", 3) == 0 && data[3] >= '1' && data[3] <= '9' &&
+       (memcmp(data + 4, bzip2_block_magic, 6) == 0 || memcmp(data + 4, bzip2_end_magic, 6) == 0))
+        return Bzip2Input;
+    return PlainInput;
+}
+
+/**
+ * Compressed input is read from the file this many bytes at a time.
+ */
+static const size_t COMPRESSED_READ_SIZE = 128*1024;
+
+/**
+ * Reads the input like read() does, decompressing it on the way if it starts with the magic bytes of gzip, zstd or
+ * bzip2. The output is written straight into the caller's buffer, so a compressed input costs no more copies than a
+ * plain one, and the decompression is done on whichever thread reads the input. Concatenated gzip members, zstd
+ * frames and bzip2 streams are read one after another, as the command line tools do. Like gzip, anything after a
+ * member that is not the start of another is ignored with a warning.
+ * Nothing is read until the first call, which reads the magic bytes. A plain input then gets back the bytes that were
+ * read to look at along with the rest of the chunk.
+ */
+class InputReader
+{
+public:
+    explicit InputReader(int input_fd) : input_fd(input_fd) {}
+
+    ~InputReader()
+    {
+        switch(compression)
+        {
+#ifdef HAVE_ZLIB
+            case GzipInput:
+                inflateEnd(&zlib_stream);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdInput:
+                ZSTD_freeDCtx(zstd_context);
+                break;
+#endif
+#ifdef HAVE_BZIP2
+            case Bzip2Input:
+                BZ2_bzDecompressEnd(&bzip2_stream);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    /**
+     * Fills buffer with up to size bytes of the input, decompressed if need be.
+     * Returns the number of bytes, 0 at the end of the input, or -1 with errno set if reading the file failed.
+     */
+    ssize_t read(uint8_t* buffer, size_t size)
+    {
+        if(__builtin_expect(!started, 0) && !start())
+            return -1;
+
+        if(compression == PlainInput)
+        {
+            /// Hand back whatever was read to look at, then carry on reading straight into the buffer
+            size_t copy_size = std::min(size, input.size() - input_offset);
+            memcpy(buffer, input.data() + input_offset, copy_size);
+            input_offset += copy_size;
+            if(copy_size == 0)
+                return ::read(input_fd, buffer, size);
+            return copy_size;
+        }
+
+        size_t produced = 0;
+        while(produced < size)
+        {
+            if(input_offset == input.size() && !input_ended && !refill())
+                return -1;
+            if(__builtin_expect(member_ended, 0) && !check_next_member())
+                return -1;
+
+            size_t consumed = input_offset;
+            size_t produced_before = produced;
+            decompress(buffer, size, produced);
+            if(input_offset == consumed && produced == produced_before && input_ended && input_offset == input.size())
+            {
+                /// Nothing more will come out
+                if(in_stream)
+                    fail("the input ends part way through its compressed data");
+                break;
+            }
+        }
+        return produced;
+    }
+
+private:
+    int input_fd;
+    bool started = false;
+    InputCompression compression = PlainInput;
+    std::vector<uint8_t> input; /// Compressed input that has been read, or the start of a plain input
+    size_t input_offset = 0; /// How much of input has been used
+    bool input_ended = false; /// Whether the file has been read to its end
+    bool in_stream = false; /// Whether a gzip member, zstd frame or bzip2 stream has been started but not finished
+    bool member_ended = false; /// Whether a gzip member has just finished, so what follows has to start another
+#ifdef HAVE_ZLIB
+    z_stream zlib_stream;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx* zstd_context;
+#endif
+#ifdef HAVE_BZIP2
+    bz_stream bzip2_stream;
+#endif
+
+    static void fail(const char* message)
+    {
+        fprintf(stderr, "Error decompressing the input: %s\n", message != nullptr ? message : "unknown error");
+        exit(1);
+    }
+
+    /**
+     * Reads the next piece of the file onto the end of the input, dropping the part that has been used.
+     * Returns false if the read failed.
+     */
+    bool refill()
+    {
+        input.erase(input.begin(), input.begin() + input_offset);
+        input_offset = 0;
+        size_t old_size = input.size();
+        input.resize(old_size + COMPRESSED_READ_SIZE);
+        ssize_t bytes_total = ::read(input_fd, input.data() + old_size, COMPRESSED_READ_SIZE);
+        input.resize(old_size + std::max<ssize_t>(bytes_total, 0));
+        input_ended = bytes_total == 0;
+        return bytes_total != -1;
+    }
+
+    /**
+     * Checks that the input after a finished gzip member starts another one. If it doesn't, the rest of the input is
+     * dropped with a warning, as gzip does with trailing garbage. Returns false if the read failed.
+     */
+    bool check_next_member()
+    {
+        member_ended = false;
+        while(input.size() - input_offset < sizeof(GZIP_MAGIC) && !input_ended)
+        {
+            if(!refill())
+                return false;
+        }
+        size_t remaining = input.size() - input_offset;
+        if(remaining != 0 && (remaining < sizeof(GZIP_MAGIC) || memcmp(input.data() + input_offset, GZIP_MAGIC, sizeof(GZIP_MAGIC)) != 0))
+        {
+            fprintf(stderr, "Warning: the compressed input is followed by trailing garbage, which is ignored\n");
+            input_offset = input.size();
+            input_ended = true;
+        }
+        return true;
+    }
+
+    /**
+     * Reads the magic bytes and sets up the decompressor they call for.
+     * Returns false if the read failed.
+     */
+    bool start()
+    {
+        started = true;
+        while(input.size() < COMPRESSION_MAGIC_SIZE && !input_ended)
+        {
+            if(!refill())
+                return false;
+        }
+
+        compression = input_compression(input.data(), input.size());
+        switch(compression)
+        {
+            case PlainInput:
+                break;
+#ifdef HAVE_ZLIB
+            case GzipInput:
+                /// A window of 2^15 bytes with 16 added reads a gzip header and trailer rather than zlib's
+                zlib_stream = z_stream();
+                if(inflateInit2(&zlib_stream, 15 + 16) != Z_OK)
+                    fail(zlib_stream.msg);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdInput:
+                zstd_context = ZSTD_createDCtx();
+                if(zstd_context == nullptr)
+                    fail("out of memory");
+                break;
+#endif
+#ifdef HAVE_BZIP2
+            case Bzip2Input:
+                bzip2_stream = bz_stream();
+                if(BZ2_bzDecompressInit(&bzip2_stream, 0, 0) != BZ_OK)
+                    fail("out of memory");
+                break;
+#endif
+            default:
+            {
+                static const char* names[] = {"", "zlib", "zstd", "bzip2"};
+                fprintf(stderr, "The input is compressed, but this was built without %s to decompress it\n", names[compression]);
+                exit(1);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Decompresses as much of the input as fits in the buffer after produced, and adds what was written to produced.
+     * A finished stream is set up again for one that may follow it.
+     */
+    void decompress(uint8_t* buffer, size_t size, size_t& produced)
+    {
+        const uint8_t* next_input = input.data() + input_offset;
+        size_t available = input.size() - input_offset;
+        switch(compression)
+        {
+#ifdef HAVE_ZLIB
+            case GzipInput:
+            {
+                zlib_stream.next_in = const_cast<Bytef*>(next_input);
+                zlib_stream.avail_in = uInt(available);
+                zlib_stream.next_out = buffer + produced;
+                zlib_stream.avail_out = uInt(size - produced);
+                int result = inflate(&zlib_stream, Z_NO_FLUSH);
+                input_offset += available - zlib_stream.avail_in;
+                produced = size - zlib_stream.avail_out;
+                if(result == Z_STREAM_END)
+                {
+                    inflateReset(&zlib_stream);
+                    in_stream = false;
+                    member_ended = true;
+                }
+                else if(result == Z_OK)
+                    in_stream = true;
+                else if(result != Z_BUF_ERROR)
+                    fail(zlib_stream.msg); /// No progress is only an error if the input has run out, which the caller checks
+                break;
+            }
+#endif
+#ifdef HAVE_ZSTD
+            case ZstdInput:
+            {
+                ZSTD_inBuffer in_buffer = {next_input, available, 0};
+                ZSTD_outBuffer out_buffer = {buffer, size, produced};
+                size_t result = ZSTD_decompressStream(zstd_context, &out_buffer, &in_buffer);
+                if(ZSTD_isError(result))
+                    fail(ZSTD_getErrorName(result));
+                input_offset += in_buffer.pos;
+                if(in_buffer.pos != 0 || out_buffer.pos != produced)
+                    in_stream = result != 0; /// 0 once a frame has been decoded and flushed in full
+                produced = out_buffer.pos;
+                break;
+            }
+#endif
+#ifdef HAVE_BZIP2
+            case Bzip2Input:
+            {
+                bzip2_stream.next_in = reinterpret_cast<char*>(const_cast<uint8_t*>(next_input));
+                bzip2_stream.avail_in = unsigned(available);
+                bzip2_stream.next_out = reinterpret_cast<char*>(buffer + produced);
+                bzip2_stream.avail_out = unsigned(size - produced);
+                int result = BZ2_bzDecompress(&bzip2_stream);
+                input_offset += available - bzip2_stream.avail_in;
+                produced = size - bzip2_stream.avail_out;
+                if(result == BZ_STREAM_END)
+                {
+                    /// bzip2 has no reset, the stream is set up anew for any that follows
+                    BZ2_bzDecompressEnd(&bzip2_stream);
+                    bzip2_stream = bz_stream();
+                    if(BZ2_bzDecompressInit(&bzip2_stream, 0, 0) != BZ_OK)
+                        fail("out of memory");
+                    in_stream = false;
+                }
+                else if(result == BZ_OK)
+                    in_stream = in_stream || available != 0;
+                else
+                    fail("the bzip2 data is corrupt");
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+    }
+};
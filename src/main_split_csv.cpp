@@ -5,8 +5,92 @@
 #include <cstring>
 #include <cstdlib>
 #include <map>
+#include <thread>
 #include "csv_splitter.hpp"
 
+/**
+ * Parses a size in bytes, with an optional K, M or G suffix.
+ */
+size_t parse_size(const std::string& text)
+{
+    char* suffix;
+    size_t size = strtoull(text.c_str(), &suffix, 10);
+    const char* units = "KMG";
+    const char* unit = *suffix == '\0' ? nullptr : strchr(units, toupper(*suffix));
+    if(unit != nullptr)
+        size <<= 10*(unit - units + 1);
+    return size;
+}
+
+/**
+ * Parses a compression method with an optional level, such as zstd or zstd:19.
+ */
+OutputCompression parse_compression(const std::string& text)
+{
+    static const std::map<std::string, CompressionMethod> methods = {{"gzip", GzipCompression}, {"zstd", ZstdCompression}, {"lz4", Lz4Compression}};
+    size_t colon = text.find(':');
+    auto found = methods.find(text.substr(0, colon));
+    if(found == methods.end())
+    {
+        fprintf(stderr, "Unknown compression: %s\n", text.c_str());
+        exit(1);
+    }
+    
+    OutputCompression compression;
+    compression.method = found->second;
+    if(colon != std::string::npos)
+        compression.level = atoi(text.substr(colon + 1).c_str());
+    if(!compression.available())
+    {
+        fprintf(stderr, "Built without %s, the column files can't be compressed with it\n", found->first.c_str());
+        exit(1);
+    }
+    return compression;
+}
+
+/**
+ * Parses a list of column numbers, inclusive ranges and header names such as 0,3,7-12,price.
+ * Anything that isn't a number or a range of numbers is taken to be a name.
+ */
+ColumnSelection parse_column_selection(const std::string& text)
+{
+    ColumnSelection selection;
+    size_t position = 0;
+    while(position <= text.size())
+    {
+        size_t comma = std::min(text.find(',', position), text.size());
+        std::string item = text.substr(position, comma - position);
+        position = comma + 1;
+        
+        size_t first, last;
+        int consumed = 0;
+        if(item.empty())
+        {
+            fprintf(stderr, "Invalid column selection: %s\n", text.c_str());
+            exit(1);
+        }
+        else if(sscanf(item.c_str(), "%zu-%zu%n", &first, &last, &consumed) == 2 && size_t(consumed) == item.size() && isdigit(item[0]))
+        {
+            if(last < first)
+            {
+                fprintf(stderr, "Invalid column range: %s\n", item.c_str());
+                exit(1);
+            }
+            selection.ranges.emplace_back(first, last);
+        }
+        else if(item.find_first_not_of("0123456789") == std::string::npos)
+        {
+            first = strtoull(item.c_str(), nullptr, 10);
+            selection.ranges.emplace_back(first, first);
+        }
+        else
+        {
+            selection.names.push_back(item);
+        }
+    }
+    return selection;
+}
+
 void print_help()
 {
     static auto help = R"help(split_csv - A tool for splitting csv into column files.
@@ -19,8 +103,9 @@ containing a single column. The files themselves are in CSV format. Refer to
 RFC 4180 for details on the format this program expects. Other formats may
 result in unusual or incorrect behaviour. This program may be useful for
 performing analysis on individual columns of a CSV file. Non-rectangular CSVs
-are handled by outputting blank lines to the missing rows. The column files 
-have the XXX.csv suffix.
+are handled by outputting blank lines to the missing rows. Records may end
+with LF or CRLF, the \r of a CRLF is left out of the last column. The column
+files have the XXX.csv suffix.
 
 Options:
     --help               Prints this message and exit before processing.
@@ -29,9 +114,141 @@ Options:
                          give the complete filename. By default this is empty.
                          The program will fail if the prefix points to a 
                          non-existent directory.
+    --threads=<count>    Split the input with this many threads. This only
+                         applies to uncompressed regular files, other input
+                         is always split on one thread. The output is the same as with
+                         a single thread. By default this is 1.
+    --queue-depth=<count>
+                         Read and write on separate threads from the parser,
+                         with up to this many 16K chunks queued between them.
+                         0 does all of the I/O on the parsing thread. This 
+                         only applies when splitting on a single thread. By 
+                         default this is 8.
+    --io-uring           Write the column files through io_uring, submitting
+                         the writes in batches rather than making a system
+                         call for every buffer. Up to --queue-depth writes
+                         are in flight at once. This falls back to a writer
+                         thread if io_uring is not available.
+    --max-memory=<size>  Keep the column buffers within <size> bytes, which
+                         may end in K, M or G. The buffers are taken from a
+                         shared slab, and the columns with the most output
+                         waiting are written out when it runs out. Column 
+                         files are closed and reopened as needed to stay 
+                         within the open file limit. This is meant for inputs
+                         with a very large number of columns. The input is
+                         split on one thread, and the column files are 
+                         written from the parsing thread.
+    --columns=<list>     Only write out the listed columns, counting from 0.
+                         The list is made of column numbers, inclusive
+                         ranges and, with --header, column names separated
+                         by commas, such as 0,3,7-12,price. The other 
+                         columns are skipped while parsing and no files are
+                         made for them. The files that are made keep the
+                         names they would have had without this option. A
+                         name selects every column with that header.
+    --skip-rows=<count>  Leave out the first <count> rows, after any header.
+                         They are parsed to find where they end, but not
+                         copied anywhere.
+    --max-rows=<count>   Write at most <count> rows, and stop reading the
+                         input once they have been written.
+    --sample=<rate>      Write a random sample of the rows, each one kept
+                         with probability <rate>, such as 0.01 for about 1%.
+                         The sample is the same on every run. With 
+                         --skip-rows the sample is of the rows after those,
+                         and --max-rows limits the rows in the sample. Any of
+                         these options splits on one thread.
+    --rows-per-file=<count>
+                         Write each column to a series of files of <count>
+                         rows each, numbered from 0 before the suffix, such
+                         as XXX.part0007.csv. Every column has the same
+                         number of files, so they can be handed out to 
+                         workers that each read one part of every column.
+                         This splits on one thread, and can't be used with
+                         --format=typed.
+    --partition-by=<column>
+                         Share the rows out between --partitions sets of
+                         column files by the value of a key column, given by
+                         its number or, with --header, its name. The files
+                         of partition 3 are named p0003_XXX.csv after the
+                         prefix. A row goes to the partition given by a hash
+                         of its key, which is the same on every run, so two
+                         inputs split with the same number of partitions can
+                         be joined partition by partition. Every partition
+                         has a file for every column. This needs a regular
+                         file as input and splits on one thread. It can't be
+                         used with --max-memory or --header=keep.
+    --partitions=<count> The number of partitions for --partition-by.
+    --header[=keep]      The first record of the input is a header. Each 
+                         column file is named after its column's header, 
+                         with anything other than letters, digits, '-', '_'
+                         and '.' replaced by '_'. Columns without a header
+                         keep their number. Long names are cut short to fit
+                         in a file name, and a name already given to another
+                         column gets a _2, _3, ... suffix. The header is left
+                         out of the column files, unless =keep is given.
+    --format=<format>    What the column files are written as, either csv,
+                         arrow or typed. With arrow each column file is an 
+                         Arrow IPC stream with the .arrow suffix, holding a
+                         single utf8 column named like the file. The fields
+                         are written exactly as they are in the input. This
+                         can't be used with --max-memory. With typed each
+                         column's type is inferred as int64, double, bool,
+                         date or string. Integer and decimal columns are 
+                         written packed and little-endian with the .bin 
+                         suffix, integers in the narrowest of int8, int16,
+                         int32 and int64 that holds the column and decimals
+                         as doubles, and the rest as CSV. The type each
+                         column is stored as, its file and its empty rows
+                         are written to <prefix>types.json, which readers of
+                         the .bin files should go by. By default this is csv.
+    --stats              Profile each column as it is written and save the
+                         profiles to <prefix>stats.json: the number of 
+                         fields and empty fields, the shortest and longest
+                         field, the smallest, largest and total of the 
+                         fields that are numbers, and an estimate of the
+                         number of distinct values, usually within 2%.
+    --compress=<method>[:<level>]
+                         Compress each column file as it is written, with
+                         gzip, zstd or lz4, adding .gz, .zst or .lz4 to its
+                         name. Each column has its own stream, which the
+                         usual command line tools can read. The level is
+                         the method's own, by default its usual default.
+                         The columns are compressed on the writer threads,
+                         or on the parsing thread with --queue-depth=0.
+                         This only works with --format=csv, and can't be 
+                         used with --max-memory. Methods whose library was
+                         not found when building are not available.
+    --compress-threads=<count>
+                         The number of writer threads that compress the 
+                         columns, each compressing its share of them. By
+                         default this is one less than the number of cores.
+    --unquote            Write the value of each field rather than the field
+                         as it is in the input. Quoted fields lose their
+                         surrounding quotes and doubled quotes become one.
+                         To keep one value per line, a backslash in a value
+                         is written as \\ and a newline as \n. Arrow files
+                         hold the values exactly.
+    --index=<count>      Write a row index to <prefix>rows.idx, giving where
+                         every <count>th record starts in the input. Records
+                         that start inside quoted fields are placed right,
+                         so later tools can seek straight to a row, or split
+                         the input between threads, without reading it from
+                         the start. The index is little-endian uint64s, the
+                         bytes CSVRIDX1, the count, the number of rows, the
+                         bytes consumed up to the end of the last row split,
+                         then the offset of rows 0, <count>, 2*<count> and
+                         so on.
+    --dialect=<dialect>  What separates the fields of the input, either csv
+                         for commas, tsv for tabs, pipe for '|' or semicolon
+                         for ';'. Fields are quoted with double quotes in 
+                         every dialect. The column files are the same 
+                         whatever the dialect. By default this is csv.
 Arguments:
     <input_filename>     The name of the input filename. Input can be read from
-                         stdin by specifying -.
+                         stdin by specifying -. Regular files are memory mapped
+                         rather than read. Input compressed with gzip, zstd or
+                         bzip2 is recognised by its first bytes and is
+                         decompressed as it is read.
     <output_prefix>      
                          
 Example usage:
@@ -60,6 +277,7 @@ int main(int argc, char** argv)
         std::string input_filename(argv[argc - 1]);
         
         int input_fd;
+        bool use_mmap = false;
         if(input_filename == "-")
         {
             input_fd = STDIN_FILENO;
@@ -74,9 +292,18 @@ int main(int argc, char** argv)
             }
             /// Tell the OS, we need to read sequentially on the file, if there is an error, well we tried our best.
             posix_fadvise(input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            
+            /// Regular files are mapped rather than copied through read(), pipes and devices still have to be read.
+            struct stat stat_info;
+            use_mmap = fstat(input_fd, &stat_info) == 0 && S_ISREG(stat_info.st_mode);
         }
         
         std::string prefix;
+        SplitOptions options;
+        options.use_mmap = use_mmap;
+        options.queue_depth = 8;
+        bool partition_key_given = false;
+        size_t writer_count = 0;
         /// Process other arguments
         for(int i = 1; i < argc - 1; i++)
         {
@@ -90,8 +317,187 @@ int main(int argc, char** argv)
             {
                 prefix = arg.substr(9);
             }
+            else if(arg.substr(0, 10) == "--threads=")
+            {
+                options.thread_count = std::max(1, atoi(arg.substr(10).c_str()));
+            }
+            else if(arg.substr(0, 14) == "--queue-depth=")
+            {
+                options.queue_depth = std::max(0, atoi(arg.substr(14).c_str()));
+            }
+            else if(arg == "--io-uring")
+            {
+                options.use_io_uring = true;
+            }
+            else if(arg.substr(0, 13) == "--max-memory=")
+            {
+                options.max_memory = parse_size(arg.substr(13));
+            }
+            else if(arg.substr(0, 11) == "--compress=")
+            {
+                options.compression = parse_compression(arg.substr(11));
+            }
+            else if(arg.substr(0, 19) == "--compress-threads=")
+            {
+                writer_count = std::max(1, atoi(arg.substr(19).c_str()));
+            }
+            else if(arg == "--unquote")
+            {
+                options.unquote = true;
+            }
+            else if(arg.substr(0, 8) == "--index=")
+            {
+                options.index_interval = std::max(1, atoi(arg.substr(8).c_str()));
+            }
+            else if(arg.substr(0, 12) == "--skip-rows=")
+            {
+                options.rows.skip_rows = strtoull(arg.substr(12).c_str(), nullptr, 10);
+            }
+            else if(arg.substr(0, 11) == "--max-rows=")
+            {
+                options.rows.max_rows = strtoull(arg.substr(11).c_str(), nullptr, 10);
+            }
+            else if(arg.substr(0, 9) == "--sample=")
+            {
+                options.rows.sample_rate = atof(arg.substr(9).c_str());
+                if(!(options.rows.sample_rate > 0.0 && options.rows.sample_rate <= 1.0))
+                {
+                    fprintf(stderr, "The sample rate must be above 0 and at most 1: %s\n", arg.substr(9).c_str());
+                    exit(1);
+                }
+            }
+            else if(arg.substr(0, 16) == "--rows-per-file=")
+            {
+                options.rows_per_file = std::max<size_t>(1, strtoull(arg.substr(16).c_str(), nullptr, 10));
+            }
+            else if(arg.substr(0, 15) == "--partition-by=")
+            {
+                std::string key = arg.substr(15);
+                partition_key_given = true;
+                if(!key.empty() && key.find_first_not_of("0123456789") == std::string::npos)
+                    options.partitioning.key_column = strtoull(key.c_str(), nullptr, 10);
+                else
+                    options.partitioning.key_name = key;
+            }
+            else if(arg.substr(0, 13) == "--partitions=")
+            {
+                options.partitioning.partition_count = std::max<size_t>(1, strtoull(arg.substr(13).c_str(), nullptr, 10));
+            }
+            else if(arg.substr(0, 10) == "--columns=")
+            {
+                options.selection = parse_column_selection(arg.substr(10));
+            }
+            else if(arg == "--header")
+            {
+                options.header = SkipHeader;
+            }
+            else if(arg == "--header=keep")
+            {
+                options.header = KeepHeader;
+            }
+            else if(arg == "--format=csv")
+            {
+                options.format = CsvOutput;
+            }
+            else if(arg == "--format=arrow")
+            {
+                options.format = ArrowOutput;
+            }
+            else if(arg == "--format=typed")
+            {
+                options.format = TypedOutput;
+            }
+            else if(arg == "--stats")
+            {
+                options.statistics = true;
+            }
+            else if(arg.substr(0, 9) == "--format=")
+            {
+                fprintf(stderr, "Unknown output format: %s\n", arg.substr(9).c_str());
+                exit(1);
+            }
+            else if(arg == "--dialect=csv")
+            {
+                options.dialect = CsvInput;
+            }
+            else if(arg == "--dialect=tsv")
+            {
+                options.dialect = TsvInput;
+            }
+            else if(arg == "--dialect=pipe")
+            {
+                options.dialect = PipeInput;
+            }
+            else if(arg == "--dialect=semicolon")
+            {
+                options.dialect = SemicolonInput;
+            }
+            else if(arg.substr(0, 10) == "--dialect=")
+            {
+                fprintf(stderr, "Unknown dialect: %s\n", arg.substr(10).c_str());
+                exit(1);
+            }
+        }
+        
+        if(!options.selection.names.empty() && options.header == NoHeader)
+        {
+            fprintf(stderr, "Columns can only be selected by name with --header\n");
+            exit(1);
+        }
+        else if(options.format == ArrowOutput && options.max_memory != 0)
+        {
+            fprintf(stderr, "--max-memory can't be used with --format=arrow\n");
+            exit(1);
+        }
+        else if(options.format == TypedOutput && options.rows_per_file != 0)
+        {
+            fprintf(stderr, "--rows-per-file can't be used with --format=typed\n");
+            exit(1);
+        }
+        else if(partition_key_given != (options.partitioning.partition_count != 0))
+        {
+            fprintf(stderr, "--partition-by and --partitions have to be given together\n");
+            exit(1);
+        }
+        else if(!options.partitioning.key_name.empty() && options.header == NoHeader)
+        {
+            fprintf(stderr, "The partition key can only be named with --header\n");
+            exit(1);
+        }
+        else if(options.partitioning.partition_count != 0 && options.max_memory != 0)
+        {
+            fprintf(stderr, "--partition-by can't be used with --max-memory\n");
+            exit(1);
+        }
+        else if(options.partitioning.partition_count != 0 && options.header == KeepHeader)
+        {
+            fprintf(stderr, "--partition-by can't be used with --header=keep\n");
+            exit(1);
+        }
+        else if(options.compression.method != NoCompression && options.format != CsvOutput)
+        {
+            fprintf(stderr, "--compress can only be used with --format=csv\n");
+            exit(1);
+        }
+        else if(options.compression.method != NoCompression && options.max_memory != 0)
+        {
+            fprintf(stderr, "--compress can't be used with --max-memory\n");
+            exit(1);
+        }
+        
+        if(options.compression.method != NoCompression)
+        {
+            /// The compression is the slow part of the output, so by default it gets every core but the parser's
+            unsigned core_count = std::thread::hardware_concurrency();
+            options.writer_count = writer_count != 0 ? writer_count : std::max(1u, core_count > 1 ? core_count - 1 : 1u);
+            if(options.use_io_uring)
+                fprintf(stderr, "Compressed columns are written by the writer threads rather than io_uring\n");
+            options.use_io_uring = false;
         }
         
-        split_csv(input_fd, prefix);
+        if(use_mmap && options.thread_count > 1 && options.max_memory == 0)
+            split_csv_parallel(input_fd, prefix, options);
+        else
+            split_csv(input_fd, prefix, options);
     }
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A bounded queue between exactly one producer thread and one consumer thread, which only takes a lock to sleep.
+ * Each side only ever writes its own index, so a push or a pop is a load and a store with acquire/release ordering.
+ * The blocking push and pop yield for a short while when the queue is full or empty, then sleep on a condition
+ * variable until the other side makes room or adds an item, so an idle thread does not keep a core busy. The other
+ * side only takes the lock to wake a sleeper, which it finds out about from a flag.
+ */
+template<typename T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(size_t capacity) : slots(capacity + 1), head(0), tail(0), producer_waiting(false), consumer_waiting(false)
+    {
+    }
+
+    bool try_push(const T& item)
+    {
+        if(!push_item(item))
+            return false;
+        wake(consumer_waiting, not_empty);
+        return true;
+    }
+
+    bool try_pop(T& item)
+    {
+        if(!pop_item(item))
+            return false;
+        wake(producer_waiting, not_full);
+        return true;
+    }
+
+    void push(const T& item)
+    {
+        for(size_t i = 0; i < SPIN_COUNT; i++)
+        {
+            if(try_push(item))
+                return;
+            std::this_thread::yield();
+        }
+        wait(producer_waiting, not_full, [&]() { return push_item(item); });
+        wake(consumer_waiting, not_empty);
+    }
+
+    T pop()
+    {
+        T item;
+        for(size_t i = 0; i < SPIN_COUNT; i++)
+        {
+            if(try_pop(item))
+                return item;
+            std::this_thread::yield();
+        }
+        wait(consumer_waiting, not_empty, [&]() { return pop_item(item); });
+        wake(producer_waiting, not_full);
+        return item;
+    }
+
+private:
+    static const size_t SPIN_COUNT = 64; /// Yields before a blocking push or pop goes to sleep
+
+    bool push_item(const T& item)
+    {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        size_t next_tail = current_tail + 1 == slots.size() ? 0 : current_tail + 1;
+        if(next_tail == head.load(std::memory_order_acquire))
+            return false; /// Full
+
+        slots[current_tail] = item;
+        tail.store(next_tail, std::memory_order_release);
+        return true;
+    }
+
+    bool pop_item(T& item)
+    {
+        size_t current_head = head.load(std::memory_order_relaxed);
+        if(current_head == tail.load(std::memory_order_acquire))
+            return false; /// Empty
+
+        item = slots[current_head];
+        head.store(current_head + 1 == slots.size() ? 0 : current_head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Sleeps until done() succeeds. The flag is raised before done() is tried, and the other side stores its index
+     * before it looks at the flag, with a full fence in between on both sides, so one of them always sees the other.
+     */
+    template<typename Done>
+    void wait(std::atomic<bool>& waiting, std::condition_variable& condition, Done done)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while(!done())
+            condition.wait(lock);
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * Wakes the other side if it is asleep, after an index has been stored.
+     */
+    void wake(std::atomic<bool>& waiting, std::condition_variable& condition)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(__builtin_expect(waiting.load(std::memory_order_relaxed), 0))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            condition.notify_one();
+        }
+    }
+
+    std::vector<T> slots; /// One slot is always left empty to tell a full queue from an empty one
+    char head_padding[64]; /// Keep the two indices on separate cache lines
+    std::atomic<size_t> head; /// Only written by the consumer
+    char tail_padding[64];
+    std::atomic<size_t> tail; /// Only written by the producer
+    char waiting_padding[64];
+    std::atomic<bool> producer_waiting; /// Set while push is asleep on a full queue
+    std::atomic<bool> consumer_waiting; /// Set while pop is asleep on an empty queue
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "column_statistics.hpp"
+
+/**
+ * How the rows are shared out between partitions, by a hash of the value of one of their fields.
+ */
+class RowPartitioning
+{
+public:
+    size_t key_column = 0; /// The field that is hashed, counting from 0
+    std::string key_name; /// The key column picked by its header, this is turned into key_column once it is read
+    size_t partition_count = 0; /// 0 if the rows aren't partitioned
+};
+
+/**
+ * Follows one field from ptr, feeding its value to hash if it isn't null. A quoted field's value loses its quotes and
+ * each doubled quote counts once, and a \r just before the end of the row is left out, as the column output does.
+ * Returns where the field ends, at the delimiter or newline after it or at end.
+ */
+template<typename Dialect>
+const uint8_t* follow_field(const uint8_t* ptr, const uint8_t* end, StreamingHash* hash)
+{
+    if(ptr != end && *ptr == Dialect::quote)
+    {
+        const uint8_t* piece = ++ptr;
+        while(true)
+        {
+            ptr = static_cast<const uint8_t*>(memchr(ptr, Dialect::quote, end - ptr));
+            if(ptr == nullptr)
+            {
+                if(hash != nullptr)
+                    hash->add(piece, end - piece);
+                return end;
+            }
+            else if(ptr + 1 != end && *(ptr + 1) == Dialect::quote)
+            {
+                if(hash != nullptr)
+                    hash->add(piece, ptr + 1 - piece);
+                piece = ptr = ptr + 2;
+                continue;
+            }
+
+            if(hash != nullptr)
+                hash->add(piece, ptr - piece);
+            ptr++;
+            break;
+        }
+    }
+
+    /// Anything else, including whatever follows a closing quote, is taken as it is
+    const uint8_t* raw = ptr;
+    while(ptr != end && *ptr != Dialect::delimiter && *ptr != '\n')
+        ptr++;
+    if(hash != nullptr)
+    {
+        const uint8_t* raw_end = ptr;
+        if(raw_end != raw && *(raw_end - 1) == '\r' && (ptr == end || *ptr == '\n'))
+            raw_end--;
+        hash->add(raw, raw_end - raw);
+    }
+    return ptr;
+}
+
+/**
+ * Gives the partition of the row that starts at row_start, from the value of its key_column'th field. The row is read
+ * ahead as far as its key, so everything up to end has to be in memory. A row too short to have the key has an empty
+ * key. The hash is computed here rather than by std::hash, so a value goes to the same partition on every run and
+ * platform, and files partitioned the same way can be joined partition by partition.
+ */
+template<typename Dialect>
+size_t partition_of_row(const uint8_t* ptr, const uint8_t* end, size_t key_column, size_t partition_count)
+{
+    for(size_t column = 0; column != key_column; column++)
+    {
+        ptr = follow_field<Dialect>(ptr, end, nullptr);
+        if(ptr == end || *ptr == '\n')
+            return StreamingHash().finish() % partition_count;
+        ptr++;
+    }
+
+    StreamingHash hash;
+    follow_field<Dialect>(ptr, end, &hash);
+    return hash.finish() % partition_count;
+}
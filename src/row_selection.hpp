@@ -0,0 +1,77 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+
+/**
+ * Which rows of the input are written out, counting from the first row after any header.
+ */
+class RowSelection
+{
+public:
+    size_t skip_rows = 0; /// Rows at the start of the input that are left out
+    size_t max_rows = SIZE_MAX; /// The most rows that are written, the input is not read past the last of them
+    double sample_rate = 1.0; /// The chance of each row after the skipped ones being written
+    uint64_t seed = 0x2545F4914F6CDD1DULL; /// Fixed so a sample is the same every time
+
+    bool selects_all() const
+    {
+        return skip_rows == 0 && max_rows == SIZE_MAX && sample_rate >= 1.0;
+    }
+};
+
+/**
+ * Picks the rows of a RowSelection in runs: some rows to leave out, then some rows to write.
+ * A Bernoulli sample keeps each row with probability sample_rate. Rather than drawing for every row, the number of rows
+ * left out before the next kept one is drawn from the matching geometric distribution, so only the kept rows cost a
+ * random number. The generator is a SplitMix64 and the distribution is computed here rather than by <random>, so a
+ * sample is the same on every platform.
+ */
+class RowSampler
+{
+public:
+    explicit RowSampler(const RowSelection& selection = RowSelection()) : rows_left(selection.max_rows),
+        first_skip(selection.skip_rows), sample_rate(selection.sample_rate), random_state(selection.seed)
+    {
+    }
+
+    /**
+     * Gives the next run, how many rows to leave out and then how many to write before asking again.
+     * Returns false once max_rows rows have been written, or if the sample can't keep any rows.
+     */
+    bool next_run(size_t& skip_count, size_t& write_count)
+    {
+        if(rows_left == 0 || sample_rate <= 0.0)
+            return false;
+
+        skip_count = first_skip;
+        first_skip = 0;
+        if(sample_rate >= 1.0)
+        {
+            write_count = rows_left;
+        }
+        else
+        {
+            /// The number of failures before a success, from the inverse of the geometric distribution's CDF
+            double uniform = std::ldexp(double((next_random() >> 11) + 1), -53); /// In (0, 1] so the log is finite
+            double gap = std::floor(std::log(uniform)/std::log1p(-sample_rate));
+            skip_count += gap < double(SIZE_MAX - skip_count) ? size_t(gap) : SIZE_MAX - skip_count;
+            write_count = 1;
+        }
+        rows_left -= write_count;
+        return true;
+    }
+
+private:
+    size_t rows_left;
+    size_t first_skip;
+    double sample_rate;
+    uint64_t random_state;
+
+    uint64_t next_random()
+    {
+        uint64_t z = (random_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+};
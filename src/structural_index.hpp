@@ -0,0 +1,243 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * The first stage of the parser.
+ * A chunk of input is classified 64 bytes at a time into bitmasks, with one bit per input byte, that mark where the
+ * structural characters are. Bit i of mask b refers to byte 64*b + i of the chunk. The state machine then finds the
+ * next interesting character by walking the masks, rather than by making a memchr call for every field.
+ */
+static const size_t BLOCK_SIZE = 64;
+
+/**
+ * Classifies a chunk into separator (delimiter or newline) and quote masks, for the characters of a Dialect.
+ * The masks must have room for (length + 63)/64 entries, bits past the end of the chunk are always clear.
+ */
+typedef void (*IndexChunkFunction)(const uint8_t* chunk, size_t length, uint64_t* separators, uint64_t* quotes);
+
+template<typename Dialect>
+inline void index_block_scalar(const uint8_t* block, uint64_t& separators, uint64_t& quotes)
+{
+    separators = 0;
+    quotes = 0;
+    for(size_t i = 0; i < BLOCK_SIZE; i++)
+    {
+        uint64_t bit = uint64_t(1) << i;
+        if(block[i] == Dialect::delimiter || block[i] == '\n')
+            separators |= bit;
+        else if(block[i] == Dialect::quote)
+            quotes |= bit;
+    }
+}
+
+/**
+ * Drives a block classifier over a chunk.
+ * The trailing partial block is copied into a zeroed block first so the classifier can always read 64 bytes.
+ */
+#define INDEX_CHUNK_WITH(index_block) \
+size_t full_blocks = length/BLOCK_SIZE;\
+for(size_t b = 0; b < full_blocks; b++)\
+    index_block(chunk + b*BLOCK_SIZE, separators[b], quotes[b]);\
+if(length % BLOCK_SIZE != 0)\
+{\
+    alignas(BLOCK_SIZE) uint8_t last_block[BLOCK_SIZE] = {};\
+    memcpy(last_block, chunk + full_blocks*BLOCK_SIZE, length % BLOCK_SIZE);\
+    index_block(last_block, separators[full_blocks], quotes[full_blocks]);\
+}
+
+template<typename Dialect>
+inline void index_chunk_scalar(const uint8_t* chunk, size_t length, uint64_t* separators, uint64_t* quotes)
+{
+    INDEX_CHUNK_WITH(index_block_scalar<Dialect>);
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE2 is part of x86-64, so this is the baseline for x86 and needs no runtime check.
+ */
+inline uint64_t match_sse2(const __m128i* lanes, __m128i chr)
+{
+    uint64_t result = 0;
+    for(int i = 0; i < 4; i++)
+        result |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(lanes[i], chr)))) << (16*i);
+    return result;
+}
+
+template<typename Dialect>
+inline void index_block_sse2(const uint8_t* block, uint64_t& separators, uint64_t& quotes)
+{
+    __m128i lanes[4];
+    for(int i = 0; i < 4; i++)
+        lanes[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16*i));
+    separators = match_sse2(lanes, _mm_set1_epi8(char(Dialect::delimiter))) | match_sse2(lanes, _mm_set1_epi8('\n'));
+    quotes = match_sse2(lanes, _mm_set1_epi8(char(Dialect::quote)));
+}
+
+template<typename Dialect>
+inline void index_chunk_sse2(const uint8_t* chunk, size_t length, uint64_t* separators, uint64_t* quotes)
+{
+    INDEX_CHUNK_WITH(index_block_sse2<Dialect>);
+}
+
+__attribute__((target("avx2")))
+inline uint64_t match_avx2(__m256i low, __m256i high, __m256i chr)
+{
+    uint64_t low_mask = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, chr)));
+    uint64_t high_mask = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, chr)));
+    return low_mask | (high_mask << 32);
+}
+
+template<typename Dialect>
+__attribute__((target("avx2")))
+inline void index_block_avx2(const uint8_t* block, uint64_t& separators, uint64_t& quotes)
+{
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+    separators = match_avx2(low, high, _mm256_set1_epi8(char(Dialect::delimiter))) | match_avx2(low, high, _mm256_set1_epi8('\n'));
+    quotes = match_avx2(low, high, _mm256_set1_epi8(char(Dialect::quote)));
+}
+
+template<typename Dialect>
+__attribute__((target("avx2")))
+inline void index_chunk_avx2(const uint8_t* chunk, size_t length, uint64_t* separators, uint64_t* quotes)
+{
+    INDEX_CHUNK_WITH(index_block_avx2<Dialect>);
+}
+#endif
+
+/**
+ * Picks the widest classifier for the dialect that the CPU we are running on supports.
+ */
+template<typename Dialect>
+inline IndexChunkFunction select_index_chunk()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return index_chunk_avx2<Dialect>;
+    return index_chunk_sse2<Dialect>;
+#else
+    return index_chunk_scalar<Dialect>;
+#endif
+}
+
+/**
+ * The second stage of the parser.
+ * A prefix XOR over the double quote mask gives a mask of the bytes that are inside quoted strings. The opening quote
+ * is inside and the closing quote is outside, and an escaped "" pair closes and reopens the string, so it does not
+ * change the mask either side of it. Separators outside of quoted strings are then exactly the field ends, so the
+ * state machine can pass over a quoted field in a single step.
+ *
+ * The prefix XOR toggles on every quote, whereas RFC 4180 only opens a quoted string at the start of a field. Any
+ * opening quote that is neither at the start of a field nor straight after a closing quote is reported, and the
+ * chunk has to be parsed quote by quote instead.
+ *
+ * in_quotes carries whether we are inside a quoted string across chunks. at_field_start and after_closing_quote say
+ * what the byte before the chunk was. Returns true if the field separator masks can be used for the whole chunk.
+ */
+typedef bool (*ResolveQuotesFunction)(const uint64_t* separators, const uint64_t* quotes, size_t block_count, uint64_t* field_separators, bool& in_quotes, bool at_field_start, bool after_closing_quote);
+
+/**
+ * Every bit becomes the XOR of itself and all of the lower bits.
+ */
+inline uint64_t prefix_xor_shift(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/**
+ * Drives a prefix XOR over the masks of a chunk, all of the carries between blocks are done without branching.
+ */
+#define RESOLVE_QUOTES_WITH(prefix_xor) \
+uint64_t inside_carry = in_quotes ? ~uint64_t(0) : 0;\
+uint64_t field_start_carry = at_field_start;\
+uint64_t closing_quote_carry = after_closing_quote;\
+uint64_t misplaced_quotes = 0;\
+for(size_t b = 0; b < block_count; b++)\
+{\
+    uint64_t inside = prefix_xor(quotes[b]) ^ inside_carry;\
+    uint64_t opening_quotes = quotes[b] & inside;\
+    uint64_t closing_quotes = quotes[b] & ~inside;\
+    field_separators[b] = separators[b] & ~inside;\
+    uint64_t field_starts = (field_separators[b] << 1) | field_start_carry;\
+    uint64_t after_closing_quotes = (closing_quotes << 1) | closing_quote_carry;\
+    misplaced_quotes |= opening_quotes & ~(field_starts | after_closing_quotes);\
+    inside_carry = uint64_t(int64_t(inside) >> 63);\
+    field_start_carry = field_separators[b] >> 63;\
+    closing_quote_carry = closing_quotes >> 63;\
+}\
+in_quotes = inside_carry != 0;\
+return misplaced_quotes == 0;
+
+inline bool resolve_quotes_shift(const uint64_t* separators, const uint64_t* quotes, size_t block_count, uint64_t* field_separators, bool& in_quotes, bool at_field_start, bool after_closing_quote)
+{
+    RESOLVE_QUOTES_WITH(prefix_xor_shift);
+}
+
+#if defined(__x86_64__)
+/**
+ * A carry-less multiply by all ones is a prefix XOR in a single instruction.
+ */
+__attribute__((target("pclmul")))
+inline uint64_t prefix_xor_clmul(uint64_t bits)
+{
+    __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, bits), _mm_set1_epi8(char(0xFF)), 0);
+    return _mm_cvtsi128_si64(product);
+}
+
+__attribute__((target("pclmul")))
+inline bool resolve_quotes_clmul(const uint64_t* separators, const uint64_t* quotes, size_t block_count, uint64_t* field_separators, bool& in_quotes, bool at_field_start, bool after_closing_quote)
+{
+    RESOLVE_QUOTES_WITH(prefix_xor_clmul);
+}
+#endif
+
+inline ResolveQuotesFunction select_resolve_quotes()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("pclmul"))
+        return resolve_quotes_clmul;
+#endif
+    return resolve_quotes_shift;
+}
+
+/**
+ * Finds the first marked position at or after from, or chunk_end if there are none left in the chunk.
+ */
+inline const uint8_t* find_next_marked(const uint64_t* masks, const uint8_t* chunk_begin, const uint8_t* from, const uint8_t* chunk_end)
+{
+    size_t offset = from - chunk_begin;
+    size_t block = offset/BLOCK_SIZE;
+    size_t block_count = (chunk_end - chunk_begin + BLOCK_SIZE - 1)/BLOCK_SIZE;
+    if(__builtin_expect(block == block_count, 0))
+        return chunk_end;
+
+    uint64_t bits = masks[block] & (~uint64_t(0) << (offset % BLOCK_SIZE));
+    while(bits == 0)
+    {
+        if(++block == block_count)
+            return chunk_end;
+        bits = masks[block];
+    }
+    return chunk_begin + block*BLOCK_SIZE + __builtin_ctzll(bits);
+}
+
+/**
+ * Whether the byte at ptr is marked.
+ */
+inline bool is_marked(const uint64_t* masks, const uint8_t* chunk_begin, const uint8_t* ptr)
+{
+    size_t offset = ptr - chunk_begin;
+    return (masks[offset/BLOCK_SIZE] >> (offset % BLOCK_SIZE)) & 1;
+}
@@ -0,0 +1,76 @@
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "csv_tokenizer.hpp"
+#include "dialect.hpp"
+
+/**
+ * Checks the fields that CsvFieldReader gives out for a small input against the values they should have.
+ */
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if(!condition)
+    {
+        fprintf(stderr, "Failed: %s\n", what);
+        failures++;
+    }
+}
+
+int main()
+{
+    /// The long field starts in the first chunk and ends in the second, so the tokenizer has to gather it
+    std::string long_value(TOKENIZER_CHUNK_SIZE, 'x');
+    std::string input = "a,\"b,\"\"c\"\"\",\r\n" + long_value + ",\"plain\"\n\"q\nr\",z";
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+    const uint8_t* end = begin + input.size();
+
+    struct Expected
+    {
+        size_t row;
+        size_t column;
+        std::string value;
+    };
+    std::vector<Expected> expected = {
+        {0, 0, "a"},
+        {0, 1, "b,\"c\""}, /// Doubled quotes, unquoted by FieldUnquoter
+        {0, 2, ""}, /// The \r of the CRLF is not part of the field
+        {1, 0, long_value},
+        {1, 1, "plain"},
+        {2, 0, "q\nr"},
+        {2, 1, "z"} /// No newline at the end of the input
+    };
+
+    CsvFieldReader<CsvDialect> reader(begin, end);
+    CsvField field;
+    size_t count = 0;
+    while(reader.next(field))
+    {
+        if(count < expected.size())
+        {
+            const Expected& want = expected[count];
+            std::string value(reinterpret_cast<const char*>(field.data), field.size);
+            check(field.row == want.row, "row number");
+            check(field.column == want.column, "column number");
+            check(value == want.value, "field value");
+            if(want.value == long_value)
+            {
+                uintptr_t data = reinterpret_cast<uintptr_t>(field.data);
+                check(data < uintptr_t(begin) || data >= uintptr_t(end), "a field across two chunks is gathered");
+            }
+            else if(want.value == "plain")
+            {
+                check(field.data == begin + input.find("plain"), "a quoted field with no doubled quotes points into the input");
+            }
+        }
+        count++;
+    }
+    check(count == expected.size(), "number of fields");
+
+    CsvFieldReader<CsvDialect> empty_reader(begin, begin);
+    check(!empty_reader.next(field), "an empty input has no fields");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,357 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "dialect.hpp"
+#include "structural_index.hpp"
+
+/**
+ * Checks that every way of splitting gives the same column files, on inputs made to trip up the structural index.
+ * The vectorised classifiers are compared with the scalar one and the carry-less multiply prefix XOR with the shifting
+ * one. Then ./split_csv splits each input mapped on one thread, mapped on several threads and read from stdin, and
+ * every split is compared with a plain byte at a time splitter. The inputs put quotes, doubled quotes, quoted
+ * newlines, unterminated quotes, empty trailing fields and CRLF row ends across the 64 byte blocks, the 16K chunks and
+ * wherever the threads' segments fall.
+ */
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+    if(!condition)
+    {
+        fprintf(stderr, "Failed: %s\n", what.c_str());
+        failures++;
+    }
+}
+
+static const size_t CHUNK_SIZE = 16*1024; /// The size of the chunks split_csv reads and parses
+
+/**
+ * Splits the input a byte at a time into what each column file should hold. A field that starts with a quote runs to
+ * the quote that closes it, and then like any other field to the next comma or newline. Quotes anywhere else are
+ * just characters. An unterminated quote runs to the end of the input. A \r right before the newline that ends a row,
+ * or at the very end of the input outside quotes, is part of the row's end and left out of the field.
+ */
+static std::vector<std::string> reference_split(const std::string& input)
+{
+    std::vector<std::string> columns;
+    size_t row = 0;
+    size_t column = 0;
+    size_t i = 0;
+    bool after_comma = false; /// A comma at the end of the input still starts an empty field
+    while(i < input.size() || after_comma)
+    {
+        if(column == columns.size())
+            columns.push_back(std::string(row, '\n'));
+
+        size_t field_begin = i;
+        bool unterminated = false;
+        if(input[i] == '"')
+        {
+            i++;
+            while(i < input.size())
+            {
+                if(input[i] == '"' && i + 1 < input.size() && input[i + 1] == '"')
+                    i += 2;
+                else if(input[i] == '"')
+                    break;
+                else
+                    i++;
+            }
+            if(i < input.size())
+                i++; /// The closing quote
+            else
+                unterminated = true;
+        }
+        while(i < input.size() && input[i] != ',' && input[i] != '\n')
+            i++;
+        size_t field_end = i;
+        if((i == input.size() || input[i] == '\n') && !unterminated && field_end != field_begin && input[field_end - 1] == '\r')
+            field_end--;
+        columns[column] += input.substr(field_begin, field_end - field_begin) + "\n";
+        column++;
+
+        if(i == input.size() || input[i] == '\n')
+        {
+            /// The rest of the row's columns are blank
+            for(; column < columns.size(); column++)
+                columns[column] += "\n";
+            column = 0;
+            row++;
+        }
+        after_comma = i < input.size() && input[i] == ',';
+        if(i < input.size())
+            i++; /// The comma or newline
+    }
+    return columns;
+}
+
+static std::string read_file(const std::string& path)
+{
+    std::string contents;
+    FILE* file = fopen(path.c_str(), "rb");
+    if(file == nullptr)
+        return contents;
+    char buffer[4096];
+    size_t read_size;
+    while((read_size = fread(buffer, 1, sizeof(buffer), file)) != 0)
+        contents.append(buffer, read_size);
+    fclose(file);
+    return contents;
+}
+
+static void write_file(const std::string& path, const std::string& contents)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+}
+
+static void clear_directory(const std::string& directory)
+{
+    DIR* dir = opendir(directory.c_str());
+    if(dir == nullptr)
+        return;
+    while(dirent* entry = readdir(dir))
+    {
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            unlink((directory + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+}
+
+/**
+ * Runs ./split_csv with the arguments, with stdin read from stdin_path if it is given.
+ */
+static bool run_split_csv(const std::vector<std::string>& arguments, const std::string& stdin_path = "")
+{
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        if(!stdin_path.empty())
+        {
+            int input_fd = open(stdin_path.c_str(), O_RDONLY);
+            dup2(input_fd, STDIN_FILENO);
+            close(input_fd);
+        }
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>("./split_csv"));
+        for(auto& argument : arguments)
+            argv.push_back(const_cast<char*>(argument.c_str()));
+        argv.push_back(nullptr);
+        execv("./split_csv", argv.data());
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Compares the column files in directory with what the reference splitter gives, and with nothing else there.
+ */
+static void check_columns(const std::string& directory, const std::vector<std::string>& expected, const std::string& what)
+{
+    for(size_t i = 0; i < expected.size(); i++)
+    {
+        char file_name[32];
+        snprintf(file_name, sizeof(file_name), "/c%03zu.csv", i + 1);
+        check(read_file(directory + file_name) == expected[i], what + ", column " + std::to_string(i + 1));
+    }
+    size_t file_count = 0;
+    DIR* dir = opendir(directory.c_str());
+    while(dirent* entry = readdir(dir))
+        file_count += entry->d_name[0] != '.';
+    closedir(dir);
+    check(file_count == expected.size(), what + ", number of column files");
+}
+
+/**
+ * Splits the input every way there is and checks each split against the reference.
+ */
+static void check_split(const std::string& directory, const std::string& input, const std::string& what)
+{
+    std::string input_path = directory + "/input";
+    std::string output_directory = directory + "/out";
+    std::string prefix = "--prefix=" + output_directory + "/c";
+    write_file(input_path, input);
+    std::vector<std::string> expected = reference_split(input);
+
+    std::vector<std::vector<std::string>> runs = {
+        {prefix, input_path},
+        {"--threads=2", prefix, input_path},
+        {"--threads=3", prefix, input_path},
+        {"--threads=8", prefix, input_path},
+        {prefix, "-"}
+    };
+    for(auto& run : runs)
+    {
+        std::string run_what = what + " (";
+        for(auto& argument : run)
+            run_what += (&argument == &run.front() ? "" : " ") + (argument == input_path ? std::string("file") : argument.substr(0, argument.find("=/")));
+        run_what += ")";
+
+        clear_directory(output_directory);
+        check(run_split_csv(run, run.back() == "-" ? input_path : ""), run_what + " exits successfully");
+        check_columns(output_directory, expected, run_what);
+    }
+}
+
+/**
+ * A field drawn from the ones that are hardest on the index: quoted, doubled and misplaced quotes, quoted separators,
+ * empty fields, text after a closing quote and carriage returns that are data.
+ */
+static std::string random_field(std::mt19937& random)
+{
+    static const char* const fields[] = {
+        "", "x", "abc", "\"\"", "\"\"\"\"", "\"a,b\"", "\"q\nr\"", "\"a\"\"b\"", "\"\"\"x\"\"\"", "ab\"c", "\"ab\"c",
+        "\"x\"y\"z", "\",\n,\"", "\"\n\"", "\"a\"\"\"\"\nb\"", "a\rb", "\"\r\"", "\"q\r\nr\""
+    };
+    return fields[random() % (sizeof(fields)/sizeof(fields[0]))];
+}
+
+static std::string random_input(std::mt19937& random, size_t size, const std::string& row_end)
+{
+    std::string input;
+    size_t column_count = 1 + random() % 6;
+    while(input.size() < size)
+    {
+        /// Some rows are short, to leave blank columns
+        size_t row_columns = random() % 8 == 0 ? 1 + random() % column_count : column_count;
+        for(size_t i = 0; i < row_columns; i++)
+            input += (i == 0 ? "" : ",") + random_field(random);
+        input += row_end;
+    }
+    return input;
+}
+
+/**
+ * An input whose row at offset is the piece, after a single column filler row. A run of commas before it keeps the
+ * filler in its own column when the piece has several.
+ */
+static std::string input_with_piece_at(size_t offset, const std::string& piece, const std::string& ending = "x,y\n")
+{
+    std::string input(offset - 1, 'f');
+    input += "\n" + piece + ending;
+    return input;
+}
+
+static void check_index()
+{
+    std::mt19937 random(7);
+    static const uint8_t alphabet[] = {',', '\n', '"', 'a', '\r', 0};
+    std::vector<uint8_t> chunk(4*BLOCK_SIZE);
+    uint64_t expected_separators[4], expected_quotes[4], separators[4], quotes[4];
+    for(size_t trial = 0; trial < 2000; trial++)
+    {
+        size_t length = 1 + random() % chunk.size();
+        for(auto& chr : chunk)
+            chr = alphabet[random() % sizeof(alphabet)];
+        index_chunk_scalar<CsvDialect>(chunk.data(), length, expected_separators, expected_quotes);
+        size_t block_count = (length + BLOCK_SIZE - 1)/BLOCK_SIZE;
+#if defined(__x86_64__)
+        index_chunk_sse2<CsvDialect>(chunk.data(), length, separators, quotes);
+        check(memcmp(separators, expected_separators, block_count*8) == 0 && memcmp(quotes, expected_quotes, block_count*8) == 0, "SSE2 index matches the scalar index, length " + std::to_string(length));
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+        {
+            index_chunk_avx2<CsvDialect>(chunk.data(), length, separators, quotes);
+            check(memcmp(separators, expected_separators, block_count*8) == 0 && memcmp(quotes, expected_quotes, block_count*8) == 0, "AVX2 index matches the scalar index, length " + std::to_string(length));
+        }
+#endif
+    }
+
+    for(size_t trial = 0; trial < 20000; trial++)
+    {
+        /// Sparse quotes so that quoted regions span blocks, dense ones for doubled quotes
+        size_t block_count = 1 + random() % 4;
+        bool sparse = random() % 2 == 0;
+        for(size_t b = 0; b < block_count; b++)
+        {
+            separators[b] = uint64_t(random()) << 32 | random();
+            quotes[b] = (uint64_t(random()) << 32 | random()) & ~separators[b];
+            if(sparse)
+                quotes[b] &= uint64_t(1) << (random() % 64);
+        }
+        bool in_quotes = random() % 2 == 0;
+        bool at_field_start = random() % 2 == 0;
+        bool after_closing_quote = random() % 2 == 0;
+        uint64_t expected_field_separators[4], field_separators[4];
+        bool expected_in_quotes = in_quotes;
+        bool expected_result = resolve_quotes_shift(separators, quotes, block_count, expected_field_separators, expected_in_quotes, at_field_start, after_closing_quote);
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("pclmul"))
+        {
+            check(prefix_xor_clmul(quotes[0]) == prefix_xor_shift(quotes[0]), "carry-less multiply prefix XOR matches the shifts");
+            bool clmul_in_quotes = in_quotes;
+            bool result = resolve_quotes_clmul(separators, quotes, block_count, field_separators, clmul_in_quotes, at_field_start, after_closing_quote);
+            check(result == expected_result && clmul_in_quotes == expected_in_quotes && memcmp(field_separators, expected_field_separators, block_count*8) == 0, "carry-less multiply quote resolution matches the shifts");
+        }
+#endif
+    }
+}
+
+int main()
+{
+    check_index();
+
+    char directory_template[] = "/tmp/split_modes_XXXXXX";
+    std::string directory = mkdtemp(directory_template);
+    std::string output_directory = directory + "/out";
+    mkdir(output_directory.c_str(), 0700);
+
+    /// Each piece is placed at and either side of the block and chunk boundaries
+    std::vector<std::string> pieces = {
+        "\"a,\"\"b\n\",c\n", /// A quoted field with a doubled quote and a newline
+        "\"\"\"\"\n", /// Only a doubled quote
+        "a,b,\n,,\n", /// Empty trailing fields
+        "\"x\"y\"z,w\n", /// A misplaced quote, parsed quote by quote
+        "\"\",\"\"\n", /// Empty quoted fields
+        "a,b\r\n", /// A CRLF row end
+        "\"q\r\nr\",\"x\ry\"\r\n", /// Carriage returns in quoted fields, which are kept
+        "a\r,b\r\r\n", /// Carriage returns that are not right before the newline, which are kept
+    };
+    std::vector<size_t> boundaries = {BLOCK_SIZE, 2*BLOCK_SIZE, CHUNK_SIZE, 2*CHUNK_SIZE};
+    for(size_t boundary : boundaries)
+    {
+        for(size_t shift = 0; shift < 6; shift++)
+        {
+            for(size_t i = 0; i < pieces.size(); i++)
+            {
+                std::string what = "piece " + std::to_string(i) + " at " + std::to_string(boundary) + "-" + std::to_string(shift);
+                check_split(directory, input_with_piece_at(boundary - shift, pieces[i]), what);
+            }
+        }
+        check_split(directory, input_with_piece_at(boundary - 2, "a,\"unterminated,\nquote", ""), "unterminated quote at " + std::to_string(boundary));
+    }
+    check_split(directory, "a,b\n,", "empty trailing field at the end of the input");
+    check_split(directory, "\"a\nb", "unterminated quote at the end of the input");
+    check_split(directory, "a,b\r", "carriage return at the end of the input");
+    check_split(directory, "a,\"b\r", "carriage return in an unterminated quote at the end of the input");
+    check_split(directory, "\r\n\r\na\r\n", "empty CRLF rows");
+    check_split(directory, "", "empty input");
+
+    /// Dense quoting across many chunks, so that the threads' segments start inside quoted fields
+    std::mt19937 random(11);
+    for(size_t trial = 0; trial < 24; trial++)
+    {
+        size_t size = trial % 12 < 8 ? 2000 + trial*300 : 3*CHUNK_SIZE + trial*5000;
+        check_split(directory, random_input(random, size, trial < 12 ? "\n" : "\r\n"), "random input " + std::to_string(trial));
+    }
+
+    clear_directory(output_directory);
+    rmdir(output_directory.c_str());
+    clear_directory(directory);
+    rmdir(directory.c_str());
+    return failures == 0 ? 0 : 1;
+}
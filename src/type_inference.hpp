@@ -0,0 +1,341 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include <utility>
+#include <vector>
+#include "field_boundaries.hpp"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * The types a column can be inferred as, from the narrowest to the widest.
+ */
+enum ColumnType
+{
+    Int64Column, /// An optional sign and up to 19 digits, that fits in an int64
+    DoubleColumn, /// A decimal number with an optional fraction and exponent
+    BoolColumn, /// true or false, in any case
+    DateColumn, /// An ISO 8601 calendar date, YYYY-MM-DD
+    StringColumn /// Anything else
+};
+
+static const unsigned INT64_TYPE = 1 << Int64Column;
+static const unsigned DOUBLE_TYPE = 1 << DoubleColumn;
+static const unsigned BOOL_TYPE = 1 << BoolColumn;
+static const unsigned DATE_TYPE = 1 << DateColumn;
+static const unsigned STRING_TYPE = 1 << StringColumn;
+static const unsigned ANY_TYPE = INT64_TYPE | DOUBLE_TYPE | BOOL_TYPE | DATE_TYPE | STRING_TYPE;
+
+/**
+ * Fields longer than this are taken to be strings, with room for a terminator.
+ */
+static const size_t MAX_TYPED_FIELD_SIZE = 64;
+static const size_t TYPED_FIELD_BUFFER_SIZE = MAX_TYPED_FIELD_SIZE + 1;
+
+inline const char* column_type_name(ColumnType type)
+{
+    static const char* names[] = {"int64", "double", "bool", "date", "string"};
+    return names[type];
+}
+
+inline bool is_ascii_digit(uint8_t chr)
+{
+    return unsigned(chr - '0') < 10;
+}
+
+/**
+ * Parses an integer made of an optional sign and digits, returns false if it is anything else or doesn't fit.
+ */
+inline bool parse_int64(const uint8_t* field, size_t size, int64_t& value)
+{
+    bool negative = size != 0 && field[0] == '-';
+    size_t digits_start = size != 0 && (field[0] == '-' || field[0] == '+') ? 1 : 0;
+    if(digits_start == size)
+        return false;
+
+    /// Accumulate negatively, so that the most negative int64 fits
+    int64_t total = 0;
+    for(size_t i = digits_start; i < size; i++)
+    {
+        unsigned digit = unsigned(field[i] - '0');
+        if(digit > 9 || __builtin_mul_overflow(total, 10, &total) || __builtin_sub_overflow(total, int64_t(digit), &total))
+            return false;
+    }
+    if(!negative && total == INT64_MIN)
+        return false;
+    value = negative ? total : -total;
+    return true;
+}
+
+inline bool is_double(const uint8_t* field, size_t size)
+{
+    size_t i = 0;
+    if(i < size && (field[i] == '-' || field[i] == '+'))
+        i++;
+    size_t integer_digits = 0;
+    for(; i < size && is_ascii_digit(field[i]); i++)
+        integer_digits++;
+    size_t fraction_digits = 0;
+    if(i < size && field[i] == '.')
+    {
+        for(i++; i < size && is_ascii_digit(field[i]); i++)
+            fraction_digits++;
+    }
+    if(integer_digits + fraction_digits == 0)
+        return false;
+    if(i < size && (field[i] == 'e' || field[i] == 'E'))
+    {
+        i++;
+        if(i < size && (field[i] == '-' || field[i] == '+'))
+            i++;
+        size_t exponent_digits = 0;
+        for(; i < size && is_ascii_digit(field[i]); i++)
+            exponent_digits++;
+        if(exponent_digits == 0)
+            return false;
+    }
+    return i == size;
+}
+
+/**
+ * Parses a field of unsigned digits, ended by a newline within 8 bytes of field, from one 8 byte load. Returns false if
+ * the field is anything else, and sets size to its length. Nothing past the 8 bytes is read.
+ */
+inline bool parse_short_digits(const uint8_t* field, int64_t& value, size_t& size)
+{
+    uint64_t bytes;
+    memcpy(&bytes, field, sizeof(bytes));
+    uint64_t newline_bytes = bytes ^ 0x0A0A0A0A0A0A0A0AULL;
+    uint64_t newlines = (newline_bytes - 0x0101010101010101ULL) & ~newline_bytes & 0x8080808080808080ULL;
+    if(newlines == 0)
+        return false;
+    size = __builtin_ctzll(newlines)/8;
+    if(size == 0)
+    {
+        value = 0;
+        return true;
+    }
+    
+    /// Shift the digits to the top, the bytes below them then count as leading zeros
+    uint64_t digits = (bytes - 0x3030303030303030ULL) << (8*(8 - size));
+    if(((digits + 0x7676767676767676ULL) | digits) & 0x8080808080808080ULL)
+        return false; /// Something other than a digit
+    
+    /// Combine pairs of digits, then pairs of pairs, then the two halves
+    digits = (digits*10 + (digits >> 8)) & 0x00FF00FF00FF00FFULL;
+    digits = (digits*100 + (digits >> 16)) & 0x0000FFFF0000FFFFULL;
+    value = int64_t((digits*10000 + (digits >> 32)) & 0xFFFFFFFFULL);
+    return true;
+}
+
+/**
+ * Parses a field that is_double accepted. With up to 15 significant digits and a power of ten of at most 22, both the
+ * digits and the power are exact in a double and one multiply or divide rounds correctly. Anything else goes to strtod.
+ */
+inline double parse_double(const uint8_t* field, size_t size)
+{
+    static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                           1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    size_t i = 0;
+    bool negative = field[0] == '-';
+    if(field[0] == '-' || field[0] == '+')
+        i++;
+    uint64_t mantissa = 0;
+    int digit_count = 0;
+    int exponent = 0;
+    for(; i < size && is_ascii_digit(field[i]); i++, digit_count++)
+        mantissa = mantissa*10 + (field[i] - '0');
+    if(i < size && field[i] == '.')
+    {
+        for(i++; i < size && is_ascii_digit(field[i]); i++, digit_count++, exponent--)
+            mantissa = mantissa*10 + (field[i] - '0');
+    }
+    
+    if(i == size && digit_count <= 15 && exponent >= -22)
+    {
+        double value = double(mantissa)/powers_of_ten[-exponent];
+        return negative ? -value : value;
+    }
+    
+    /// Long or exponent fields, typed fields are short enough to copy
+    char text[TYPED_FIELD_BUFFER_SIZE];
+    memcpy(text, field, size);
+    text[size] = '\0';
+    return strtod(text, nullptr);
+}
+
+inline bool is_bool(const uint8_t* field, size_t size)
+{
+    return (size == 4 && strncasecmp(reinterpret_cast<const char*>(field), "true", 4) == 0) ||
+           (size == 5 && strncasecmp(reinterpret_cast<const char*>(field), "false", 5) == 0);
+}
+
+inline bool is_date(const uint8_t* field, size_t size)
+{
+    static const char pattern[] = "dddd-dd-dd";
+    if(size != 10)
+        return false;
+    for(size_t i = 0; i < size; i++)
+    {
+        if(pattern[i] == 'd' ? !is_ascii_digit(field[i]) : field[i] != pattern[i])
+            return false;
+    }
+
+    unsigned year = (field[0] - '0')*1000 + (field[1] - '0')*100 + (field[2] - '0')*10 + (field[3] - '0');
+    unsigned month = (field[5] - '0')*10 + (field[6] - '0');
+    unsigned day = (field[8] - '0')*10 + (field[9] - '0');
+    static const unsigned month_days[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if(month < 1 || month > 12 || day < 1 || day > month_days[month - 1])
+        return false;
+    bool leap_year = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+    return month != 2 || day != 29 || leap_year;
+}
+
+/**
+ * Every type that a non-empty, unquoted field fits.
+ */
+inline unsigned field_types(const uint8_t* field, size_t size)
+{
+    unsigned types = STRING_TYPE;
+    int64_t value;
+    if(parse_int64(field, size, value))
+        types |= INT64_TYPE;
+    if(is_double(field, size))
+        types |= DOUBLE_TYPE;
+    else if(is_bool(field, size))
+        types |= BOOL_TYPE;
+    else if(is_date(field, size))
+        types |= DATE_TYPE;
+    return types;
+}
+
+/**
+ * Works out the narrowest type that fits every field of a column, and which rows are null, from the column's output
+ * as it is flushed. A quoted field can only be a string. Fields cut off by the end of a flush carry on in the next one.
+ */
+class TypeInference
+{
+public:
+    unsigned possible_types = ANY_TYPE;
+    uint64_t row_count = 0;
+    uint64_t null_count = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> null_ranges; /// Inclusive ranges of rows whose field is empty
+
+    /**
+     * The output's fields are quoted with quote, or FieldBoundaries::NO_QUOTE if the columns are unquoted.
+     */
+    explicit TypeInference(int quote = '"') : boundaries(quote)
+    {
+    }
+
+    void scan(const uint8_t* ptr, size_t size)
+    {
+        const uint8_t* end = ptr + size;
+        while(ptr != end)
+        {
+            size_t integer_size;
+            if(boundaries.at_field_start() && (possible_types & (INT64_TYPE | DOUBLE_TYPE)) != 0 && short_integer(ptr, end, integer_size))
+            {
+                /// Most fields of a numeric column are short integers, they are checked 16 bytes at a time
+                possible_types &= INT64_TYPE | DOUBLE_TYPE | STRING_TYPE;
+                row_count++;
+                ptr += integer_size + 1;
+                continue;
+            }
+            
+            bool field_ended;
+            const uint8_t* piece_end = boundaries.next_piece(ptr, end, field_ended);
+            if(boundaries.quoted() || field_size + (piece_end - ptr) > MAX_TYPED_FIELD_SIZE)
+                possible_types = STRING_TYPE;
+            else if(possible_types != STRING_TYPE && (!field_ended || !partial.empty()))
+                partial.append(ptr, piece_end); /// Keep the start of the field until the rest of it turns up
+            field_size += piece_end - ptr;
+            
+            if(field_ended)
+            {
+                if(field_size == 0)
+                    add_null();
+                else if(possible_types == STRING_TYPE)
+                    row_count++; /// Strings only need their rows counted
+                else if(partial.empty())
+                    add_field(ptr, field_size);
+                else
+                    add_field(reinterpret_cast<const uint8_t*>(partial.data()), partial.size());
+                partial.clear();
+                field_size = 0;
+                ptr = piece_end + 1;
+            }
+            else
+            {
+                ptr = piece_end;
+            }
+        }
+    }
+
+    /**
+     * Called after the last scan.
+     */
+    void finish()
+    {
+        if(boundaries.finish())
+            row_count++;
+    }
+
+    ColumnType type() const
+    {
+        if(null_count == row_count)
+            return StringColumn; /// Nothing to go on
+        return ColumnType(__builtin_ctz(possible_types));
+    }
+
+private:
+    FieldBoundaries boundaries;
+    size_t field_size = 0; /// How much of the current field has been scanned
+    std::string partial; /// The start of an unquoted field cut off at the end of the last scan
+
+    void add_field(const uint8_t* field, size_t size)
+    {
+        possible_types &= field_types(field, size);
+        row_count++;
+    }
+
+    void add_null()
+    {
+        if(!null_ranges.empty() && null_ranges.back().second + 1 == row_count)
+            null_ranges.back().second = row_count;
+        else
+            null_ranges.emplace_back(row_count, row_count);
+        null_count++;
+        row_count++;
+    }
+
+    /**
+     * Checks whether the field at ptr is an optional minus sign and up to 15 digits, using one 16 byte load. Sets size
+     * to the field's size if it is.
+     */
+    static bool short_integer(const uint8_t* ptr, const uint8_t* end, size_t& size)
+    {
+#if defined(__x86_64__)
+        if(end - ptr < 16)
+            return false;
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+        unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+        if(newlines == 0)
+            return false;
+
+        /// A byte is a digit if subtracting '0' leaves it at most 9
+        __m128i offsets = _mm_sub_epi8(bytes, _mm_set1_epi8('0'));
+        unsigned digits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(offsets, _mm_set1_epi8(9)), offsets));
+        size = __builtin_ctz(newlines);
+        unsigned first_digit = ptr[0] == '-' ? 1 : 0;
+        unsigned field_mask = ((1u << size) - 1) & ~((1u << first_digit) - 1);
+        return size > first_digit && (digits & field_mask) == field_mask;
+#else
+        return false;
+#endif
+    }
+};
@@ -0,0 +1,190 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <liburing.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "buffer_arena.hpp"
+
+/// liburing pulls in <linux/fs.h>, whose BLOCK_SIZE macro would clobber the structural index's block size
+#undef BLOCK_SIZE
+
+/**
+ * Writes column buffers through io_uring instead of calling write() for each one.
+ * Writes are queued and submitted in batches, so a wide file costs one system call per batch rather than one per
+ * flushed buffer. Every write carries its file offset, so writes to the same file may complete in any order. A flushed
+ * buffer is only handed out again once the completion for its write has come back.
+ */
+class UringWriter
+{
+public:
+    /**
+     * depth is the number of buffers from the arena that can be in flight at once, they start out buffer_size bytes.
+     * Check ready() afterwards, the kernel may not allow io_uring.
+     */
+    UringWriter(size_t depth, BufferArena& arena, size_t buffer_size) : arena(arena), requests(depth), held_size(depth*buffer_size), unsubmitted_count(0), in_flight_count(0)
+    {
+        submit_batch = std::max<size_t>(1, depth/2);
+        ring_ready = io_uring_queue_init(depth, &ring, 0) == 0;
+        for(auto& request : requests)
+        {
+            request.buffer = arena.allocate(buffer_size);
+            request.capacity = buffer_size;
+            spare_requests.push_back(&request);
+        }
+    }
+
+    ~UringWriter()
+    {
+        for(auto& request : requests)
+            arena.release(request.buffer, request.capacity);
+        if(ring_ready)
+            io_uring_queue_exit(&ring);
+    }
+
+    bool ready() const
+    {
+        return ring_ready;
+    }
+
+    /**
+     * Bytes of buffers owned by the writer, in flight or spare. The reference stays valid as long as the writer.
+     */
+    const size_t& queued_size() const
+    {
+        return held_size;
+    }
+
+    /**
+     * Queues a write of size bytes of buffer at offset in the file. buffer and its capacity are swapped for an empty
+     * buffer of spare_capacity bytes to use in its place.
+     */
+    void queue_write(int output_fd, uint8_t*& buffer, size_t& capacity, size_t size, uint64_t offset, size_t spare_capacity)
+    {
+        while(spare_requests.empty())
+        {
+            /// Every buffer is in flight, wait for one to come back
+            submit();
+            reap(true);
+        }
+
+        WriteRequest* request = spare_requests.back();
+        spare_requests.pop_back();
+        std::swap(request->buffer, buffer); /// The caller gets the spare buffer in exchange
+        std::swap(request->capacity, capacity);
+        if(capacity != spare_capacity)
+        {
+            arena.release(buffer, capacity);
+            buffer = arena.allocate(spare_capacity);
+            capacity = spare_capacity;
+        }
+        held_size += request->capacity - capacity;
+        request->output_fd = output_fd;
+        request->size = size;
+        request->offset = offset;
+
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if(sqe == nullptr)
+        {
+            /// The submission queue is full
+            submit();
+            sqe = io_uring_get_sqe(&ring);
+        }
+        io_uring_prep_write(sqe, output_fd, request->buffer, size, offset);
+        io_uring_sqe_set_data(sqe, request);
+        in_flight_count++;
+        if(++unsubmitted_count >= submit_batch)
+            submit();
+
+        /// Recycle whatever has finished in the meantime without waiting
+        reap(false);
+    }
+
+    /**
+     * Waits for every queued write to finish.
+     */
+    void finish()
+    {
+        submit();
+        while(in_flight_count != 0)
+            reap(true);
+    }
+
+private:
+    class WriteRequest
+    {
+    public:
+        int output_fd;
+        uint8_t* buffer;
+        size_t capacity; /// The size the buffer was allocated with
+        size_t size;
+        uint64_t offset;
+    };
+
+    BufferArena& arena;
+    io_uring ring;
+    bool ring_ready;
+    std::vector<WriteRequest> requests;
+    std::vector<WriteRequest*> spare_requests; /// Requests whose buffer is free to hand out
+    size_t held_size;
+    size_t submit_batch;
+    size_t unsubmitted_count;
+    size_t in_flight_count;
+
+    void submit()
+    {
+        if(unsubmitted_count == 0)
+            return;
+        int result = io_uring_submit(&ring);
+        if(result < 0)
+        {
+            errno = -result;
+            perror("Error submitting writes");
+            exit(1);
+        }
+        unsubmitted_count = 0;
+    }
+
+    /**
+     * Recycles the buffers of completed writes, if wait is set this blocks until at least one completes.
+     */
+    void reap(bool wait)
+    {
+        io_uring_cqe* cqe;
+        int result = wait ? io_uring_wait_cqe(&ring, &cqe) : io_uring_peek_cqe(&ring, &cqe);
+        while(result == 0)
+        {
+            WriteRequest* request = static_cast<WriteRequest*>(io_uring_cqe_get_data(cqe));
+            if(cqe->res < 0)
+            {
+                errno = -cqe->res;
+                perror("Error writing file");
+                exit(1);
+            }
+            else if(size_t(cqe->res) != request->size)
+            {
+                /// A short write, finish it off synchronously
+                size_t written = cqe->res;
+                while(written != request->size)
+                {
+                    ssize_t write_result = pwrite(request->output_fd, request->buffer + written, request->size - written, request->offset + written);
+                    if(write_result == -1)
+                    {
+                        perror("Error writing file");
+                        exit(1);
+                    }
+                    written += write_result;
+                }
+            }
+            io_uring_cqe_seen(&ring, cqe);
+            spare_requests.push_back(request);
+            in_flight_count--;
+            result = io_uring_peek_cqe(&ring, &cqe);
+        }
+    }
+};